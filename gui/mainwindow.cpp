@@ -108,8 +108,16 @@ MainWindow::MainWindow(QWidget *parent)
     sendButton = new QPushButton("Run Code", this);
     sendButton->setEnabled(false); // Disabled until connected
 
+    stopButton = new QPushButton("Stop", this);
+    stopButton->setEnabled(false); // Enabled while code runs
+
+    auto *buttonLayout = new QHBoxLayout();
+    buttonLayout->addStretch();
+    buttonLayout->addWidget(stopButton);
+    buttonLayout->addWidget(sendButton);
+
     inputLayout->addWidget(inputEditor);
-    inputLayout->addWidget(sendButton, 0, Qt::AlignRight);
+    inputLayout->addLayout(buttonLayout);
 
     mainLayout->addWidget(inputGroup, 0);
 
@@ -120,10 +128,20 @@ MainWindow::MainWindow(QWidget *parent)
     // --- Signals ---
     connect(connectButton, &QPushButton::clicked, this, &MainWindow::onConnectClicked);
     connect(sendButton, &QPushButton::clicked, this, &MainWindow::onSendClicked);
+    connect(stopButton, &QPushButton::clicked, this, &MainWindow::onStopClicked);
 }
 
 void MainWindow::onConnectClicked() {
     if (client.isConnected()) {
+        // May run from the notifier's own activated() signal, so it is
+        // only deleted once that returns.
+        if (socketNotifier) {
+            socketNotifier->setEnabled(false);
+            socketNotifier->deleteLater();
+        }
+        socketNotifier = nullptr;
+        running = false;
+        stopButton->setEnabled(false);
         try {
             client.close();
         } catch(...) {}
@@ -147,6 +165,9 @@ void MainWindow::onConnectClicked() {
             // Re-create client with new host/port
             client = Client(host.toStdString(), static_cast<uint16_t>(port));
             client.connectTo();
+
+            socketNotifier = new QSocketNotifier(client.fd(), QSocketNotifier::Read, this);
+            connect(socketNotifier, &QSocketNotifier::activated, this, &MainWindow::onSocketReadable);
             
             statusLabel->setText("Connected");
             statusLabel->setStyleSheet("color: #51cf66; font-weight: bold;");
@@ -164,28 +185,54 @@ void MainWindow::onConnectClicked() {
 
 void MainWindow::onSendClicked() {
     QString message = inputEditor->toPlainText();
-    if (message.trimmed().isEmpty()) return;
+    if (message.trimmed().isEmpty() || running) return;
 
     outputArea->append("<b>> Sending code for execution...</b>");
     traceArea->clear(); 
     traceArea->append("<b>--- New Execution ---</b>");
 
     try {
-        client.trace(message.toStdString(), 
+        runningId = client.traceAsync(message.toStdString(),
             [this](const std::string& line) {
                 traceArea->append(QString::fromStdString(line).trimmed());
-                QApplication::processEvents();
             },
             [this](const std::string& line) {
                 outputArea->append(QString::fromStdString(line).trimmed());
-                QApplication::processEvents();
+            },
+            [this](const std::string& busyReason) {
+                if (!busyReason.empty())
+                    outputArea->append("<font color='#ff6b6b'>Server busy: " + QString::fromStdString(busyReason) + "</font>");
+                running = false;
+                sendButton->setEnabled(true);
+                stopButton->setEnabled(false);
             }
         );
+        running = true;
+        sendButton->setEnabled(false);
+        stopButton->setEnabled(true);
     } catch (const std::exception &e) {
         outputArea->append("<font color='#ff6b6b'>Error: " + QString::fromStdString(e.what()) + "</font>");
-        // Check if error was due to connection loss
-        if (!client.isConnected()) {
-             onConnectClicked(); // Reset UI state to disconnected
-        }
+        onConnectClicked(); // Reset UI state to disconnected
+    }
+}
+
+void MainWindow::onStopClicked() {
+    if (!running) return;
+    try {
+        client.cancel(runningId);
+        stopButton->setEnabled(false);
+        outputArea->append("<i>Stopping...</i>");
+    } catch (const std::exception &e) {
+        outputArea->append("<font color='#ff6b6b'>Error: " + QString::fromStdString(e.what()) + "</font>");
+        onConnectClicked();
+    }
+}
+
+void MainWindow::onSocketReadable() {
+    try {
+        client.poll();
+    } catch (const std::exception &e) {
+        outputArea->append("<font color='#ff6b6b'>Error: " + QString::fromStdString(e.what()) + "</font>");
+        onConnectClicked(); // Reset UI state to disconnected
     }
 }
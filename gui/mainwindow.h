@@ -3,6 +3,7 @@
 #include <QLineEdit>
 #include <QTextEdit>
 #include <QPushButton>
+#include <QSocketNotifier>
 #include "Client.h"
 
 #include <QLabel>
@@ -17,6 +18,8 @@ public:
 private slots:
     void onSendClicked();
     void onConnectClicked();
+    void onStopClicked();
+    void onSocketReadable();
 
 private:
     // Connection UI
@@ -30,6 +33,13 @@ private:
     QTextEdit *outputArea;
     QTextEdit *traceArea;
     QPushButton *sendButton;
+    QPushButton *stopButton;
+
+    // Frames of the running trace are read as they arrive, from the event
+    // loop, so Stop stays clickable while the program runs.
+    QSocketNotifier *socketNotifier = nullptr;
+    uint32_t runningId = 0;
+    bool running = false;
 
     Client client;
 };
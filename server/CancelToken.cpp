@@ -0,0 +1,45 @@
+#include "CancelToken.h"
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+CancelToken::~CancelToken() {
+    if (m_fd >= 0) ::close(m_fd);
+}
+
+bool CancelToken::cancel() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_cancelled.load()) return false;
+    m_at = Clock::now();
+    m_cancelled.store(true);
+    if (m_fd >= 0) ::eventfd_write(m_fd, 1);
+    if (m_interrupt) m_interrupt();
+    if (m_always) m_always();
+    return true;
+}
+
+CancelToken::Clock::time_point CancelToken::cancelledAt() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_at;
+}
+
+void CancelToken::onCancel(std::function<void()> interrupt) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_interrupt = std::move(interrupt);
+    // Interruptions only kill or wake, so they may run under the lock.
+    if (m_interrupt && m_cancelled.load()) m_interrupt();
+}
+
+void CancelToken::onCancelAlways(std::function<void()> interrupt) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_always = std::move(interrupt);
+    if (m_always && m_cancelled.load()) m_always();
+}
+
+int CancelToken::fd() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_fd < 0) {
+        m_fd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (m_fd >= 0 && m_cancelled.load()) ::eventfd_write(m_fd, 1);
+    }
+    return m_fd;
+}
@@ -0,0 +1,61 @@
+#ifndef CANCELTOKEN_H
+#define CANCELTOKEN_H
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+
+// Cancellation of one TRACE request, by a CANCEL frame or because its
+// client went away. Whatever the request is blocked on at the moment (the
+// compile queue, g++, another request's compile, the traced program)
+// registers how to interrupt it, so the worker is freed right away.
+class CancelToken {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    CancelToken() = default;
+    ~CancelToken();
+    CancelToken(const CancelToken&) = delete;
+    CancelToken& operator=(const CancelToken&) = delete;
+
+    // Interrupts the registered wait. Returns false if already cancelled.
+    bool cancel();
+    bool cancelled() const noexcept { return m_cancelled.load(); }
+    // When cancel() was first called.
+    Clock::time_point cancelledAt() const;
+
+    // Installs the interruption for what the request waits on next, or
+    // removes it when empty. Runs it at once if already cancelled.
+    void onCancel(std::function<void()> interrupt);
+    // Same, for the whole request rather than one wait: its output, which
+    // any phase may be blocked on besides its own wait.
+    void onCancelAlways(std::function<void()> interrupt);
+    // An eventfd that becomes readable once cancelled, for waits in poll().
+    int fd();
+
+    // Keeps an interruption installed for the lifetime of a scope.
+    class Scope {
+    public:
+        Scope(CancelToken& token, std::function<void()> interrupt) : m_token(token) {
+            m_token.onCancel(std::move(interrupt));
+        }
+        ~Scope() { m_token.onCancel(nullptr); }
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        CancelToken& m_token;
+    };
+
+private:
+    mutable std::mutex m_mutex;
+    std::atomic<bool> m_cancelled{false};
+    Clock::time_point m_at;
+    std::function<void()> m_interrupt;
+    std::function<void()> m_always;
+    int m_fd = -1;
+};
+
+#endif
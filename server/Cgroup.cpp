@@ -0,0 +1,94 @@
+#include "Cgroup.h"
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <unistd.h>
+
+static const long kCgroup2Magic = 0x63677270;
+// Shared by the processes that outlive their run.
+static const char* kKeptGroup = "/kept";
+
+static bool writeFile(const std::string& path, const std::string& value) {
+    int fd = ::open(path.c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    bool ok = ::write(fd, value.data(), value.size()) == static_cast<ssize_t>(value.size());
+    ::close(fd);
+    return ok;
+}
+
+static std::string readFile(const std::string& path) {
+    std::string text;
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return text;
+    char buf[4096];
+    ssize_t n;
+    while ((n = ::read(fd, buf, sizeof(buf))) > 0) text.append(buf, static_cast<size_t>(n));
+    ::close(fd);
+    return text;
+}
+
+bool Cgroup::prepare(const std::string& parent) {
+    ::mkdir(parent.c_str(), 0755);
+    struct statfs fs{};
+    if (::statfs(parent.c_str(), &fs) != 0 || static_cast<long>(fs.f_type) != kCgroup2Magic) return false;
+    // Each controller on its own: one the kernel does not delegate here
+    // must not keep the others off.
+    for (const char* controller : {"+cpu", "+memory", "+pids"})
+        writeFile(parent + "/cgroup.subtree_control", controller);
+    ::mkdir((parent + kKeptGroup).c_str(), 0755);
+    return ::access((parent + "/cgroup.procs").c_str(), W_OK) == 0;
+}
+
+Cgroup::Cgroup(const std::string& parent, const std::string& name)
+    : m_parent(parent), m_path(parent + "/" + name), m_valid(false) {
+    m_valid = ::mkdir(m_path.c_str(), 0755) == 0 || errno == EEXIST;
+}
+
+Cgroup::~Cgroup() {
+    if (!m_valid) return;
+    if (!writeFile(m_path + "/cgroup.kill", "1")) {
+        // Kernels before 5.14 have no cgroup.kill.
+        std::string procs = readFile(m_path + "/cgroup.procs");
+        const char* p = procs.c_str();
+        char* end;
+        for (long pid = std::strtol(p, &end, 10); end != p; pid = std::strtol(p, &end, 10)) {
+            ::kill(static_cast<pid_t>(pid), SIGKILL);
+            p = end;
+        }
+    }
+    // Killed processes leave the group once they are reaped, which the
+    // tracer may still be doing.
+    for (int attempt = 0; attempt < 100 && ::rmdir(m_path.c_str()) != 0 && errno == EBUSY; ++attempt)
+        ::usleep(1000);
+}
+
+bool Cgroup::set(const char* file, const std::string& value) {
+    return m_valid && writeFile(m_path + "/" + file, value);
+}
+
+bool Cgroup::add(pid_t pid) {
+    return m_valid && writeFile(m_path + "/cgroup.procs", std::to_string(pid));
+}
+
+void Cgroup::keep(pid_t pid) {
+    if (m_valid) writeFile(m_parent + kKeptGroup + "/cgroup.procs", std::to_string(pid));
+}
+
+uint64_t Cgroup::counter(const char* file, const char* key) const {
+    if (!m_valid) return 0;
+    std::string text = readFile(m_path + "/" + file);
+    size_t keyLen = std::strlen(key);
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t end = text.find('\n', pos);
+        if (end == std::string::npos) end = text.size();
+        if (text.compare(pos, keyLen, key) == 0 && pos + keyLen < end && text[pos + keyLen] == ' ')
+            return std::strtoull(text.c_str() + pos + keyLen + 1, nullptr, 10);
+        pos = end + 1;
+    }
+    return 0;
+}
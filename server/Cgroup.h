@@ -0,0 +1,42 @@
+#ifndef CGROUP_H
+#define CGROUP_H
+#pragma once
+#include <cstdint>
+#include <string>
+#include <sys/types.h>
+
+// A cgroup v2 of its own for one traced run, under a parent directory the
+// server was given (and may write to). Its limits hold for everything the
+// run forks, which rlimits cannot do, and what is left of the run can be
+// killed as a whole.
+class Cgroup {
+public:
+    // Makes `parent` ready to hold run groups: it must be on a cgroup v2
+    // mount, and the cpu, memory and pids controllers are enabled for its
+    // children where the kernel allows. False when it cannot be used.
+    static bool prepare(const std::string& parent);
+
+    Cgroup(const std::string& parent, const std::string& name);
+    // Kills whatever still runs in the group and removes it.
+    ~Cgroup();
+
+    Cgroup(const Cgroup&) = delete;
+    Cgroup& operator=(const Cgroup&) = delete;
+
+    bool valid() const noexcept { return m_valid; }
+    // Writes one of the group's control files, e.g. ("memory.max", "1048576").
+    bool set(const char* file, const std::string& value);
+    bool add(pid_t pid);
+    // Moves `pid` out, to a group shared by the processes that outlive
+    // their run (a committed snapshot).
+    void keep(pid_t pid);
+    // The value of `key` in a flat keyed file such as memory.events.
+    uint64_t counter(const char* file, const char* key) const;
+
+private:
+    std::string m_parent;
+    std::string m_path;
+    bool m_valid;
+};
+
+#endif
@@ -0,0 +1,282 @@
+#include "CompileCache.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Temporary files (and the per-run links of older versions) older than
+// this were left by a process that died; the eviction scan removes them.
+static const time_t kStaleSeconds = 3600;
+
+// The precompiled prelude is built in .tmp.pch.<pid>; the directory is left
+// behind when that process dies during the build.
+static bool staleBuildDir(const std::string& pid, time_t age) {
+    if (age > kStaleSeconds) return true;
+    char* end = nullptr;
+    long n = std::strtol(pid.c_str(), &end, 10);
+    return n > 0 && *end == '\0' && ::kill(static_cast<pid_t>(n), 0) < 0 && errno == ESRCH;
+}
+
+// Layout of the running totals at the start of <dir>/.lock.
+struct Totals {
+    uint64_t magic;
+    uint64_t bytes;
+    uint64_t entries;
+};
+static const uint64_t kTotalsMagic = 0x31736c61746f7470ULL;
+
+CompileCache::CompileCache(size_t budgetBytes, const std::string& dir)
+    : m_budget(budgetBytes), m_dir(dir), m_lock_fd(-1), m_next_file(0)
+{
+    m_stats.budget = m_budget;
+    if (::mkdir(m_dir.c_str(), 0700) < 0 && errno != EEXIST) {
+        std::cerr << "Compile cache: cannot create " << m_dir << ": " << strerror(errno) << "\n";
+        return;
+    }
+    m_lock_fd = ::open((m_dir + "/.lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (m_lock_fd < 0) {
+        std::cerr << "Compile cache: cannot open lock in " << m_dir << ": " << strerror(errno) << "\n";
+        return;
+    }
+
+    // Picks up what earlier runs (or other processes) left behind.
+    ::flock(m_lock_fd, LOCK_EX);
+    evictLocked();
+    ::flock(m_lock_fd, LOCK_UN);
+}
+
+CompileCache::~CompileCache() {
+    if (m_lock_fd >= 0) ::close(m_lock_fd);
+}
+
+// FNV-1a over the source, a separator and the compiler command.
+uint64_t CompileCache::hashKey(const std::string& source, const std::string& compiler) {
+    uint64_t h = 1469598103934665603ULL;
+    auto mix = [&h](const std::string& s) {
+        for (unsigned char c : s) {
+            h ^= c;
+            h *= 1099511628211ULL;
+        }
+    };
+    mix(source);
+    h ^= 0xff;
+    h *= 1099511628211ULL;
+    mix(compiler);
+    return h;
+}
+
+std::string CompileCache::entryPath(uint64_t key, const char* suffix) const {
+    char name[24];
+    std::snprintf(name, sizeof(name), "/%016llx", static_cast<unsigned long long>(key));
+    return m_dir + name + suffix;
+}
+
+std::string CompileCache::privateName(const char* kind) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_dir + "/." + kind + "." + std::to_string(getpid()) + "." + std::to_string(++m_next_file);
+}
+
+std::string CompileCache::keyedCompiler(const std::string& compiler) const {
+    return m_identity.empty() ? compiler : m_identity + '\n' + compiler;
+}
+
+int CompileCache::find(const std::string& source, const std::string& command) {
+    int fd = -1;
+    if (m_lock_fd >= 0) {
+        std::string compiler = keyedCompiler(command);
+        uint64_t key = hashKey(source, compiler);
+        // The keyed text is compared in full, so a hash collision is a miss
+        // rather than somebody else's binary.
+        std::ifstream in(entryPath(key, ".src"), std::ios::binary);
+        std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        if (in && text == compiler + '\0' + source) {
+            std::string bin = entryPath(key, ".bin");
+            fd = ::open(bin.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd >= 0) ::utimensat(AT_FDCWD, bin.c_str(), nullptr, 0);
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (fd >= 0) ++m_stats.hits;
+    else ++m_stats.misses;
+    return fd;
+}
+
+void CompileCache::insert(const std::string& source, const std::string& command, int binaryFd) {
+    std::string compiler = keyedCompiler(command);
+    struct stat st{};
+    if (m_lock_fd < 0 || ::fstat(binaryFd, &st) < 0) return;
+    if (static_cast<size_t>(st.st_size) > m_budget) return;
+
+    std::string tmpBin = privateName("tmp");
+    int out = ::open(tmpBin.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0700);
+    if (out < 0) return;
+    off_t offset = 0;
+    while (offset < st.st_size) {
+        ssize_t n = ::sendfile(out, binaryFd, &offset, static_cast<size_t>(st.st_size - offset));
+        if (n <= 0) break;
+    }
+    ::close(out);
+    if (offset < st.st_size) {
+        ::unlink(tmpBin.c_str());
+        return;
+    }
+
+    std::string tmpSrc = privateName("tmp");
+    {
+        std::ofstream src(tmpSrc, std::ios::binary);
+        src << compiler << '\0' << source;
+    }
+
+    uint64_t key = hashKey(source, compiler);
+    std::string srcPath = entryPath(key, ".src");
+    std::string binPath = entryPath(key, ".bin");
+    uint64_t added = static_cast<uint64_t>(st.st_size) + compiler.size() + 1 + source.size();
+    ::flock(m_lock_fd, LOCK_EX);
+    // Whatever the renames replace no longer counts.
+    uint64_t replaced = 0;
+    bool existed = false;
+    struct stat old{};
+    if (::stat(srcPath.c_str(), &old) == 0) {
+        replaced += static_cast<uint64_t>(old.st_size);
+        existed = true;
+    }
+    if (::stat(binPath.c_str(), &old) == 0) {
+        replaced += static_cast<uint64_t>(old.st_size);
+        existed = true;
+    }
+    // The text goes first: a reader that finds it and an older binary of
+    // the same key at worst misses, since the key covers the text.
+    bool ok = ::rename(tmpSrc.c_str(), srcPath.c_str()) == 0 &&
+              ::rename(tmpBin.c_str(), binPath.c_str()) == 0;
+    if (ok) {
+        uint64_t bytes = 0, entries = 0;
+        if (!loadTotalsLocked(bytes, entries)) {
+            evictLocked();
+        } else {
+            bytes = bytes > replaced ? bytes - replaced : 0;
+            bytes += added;
+            if (!existed) ++entries;
+            if (bytes > m_budget) evictLocked();
+            else storeTotalsLocked(bytes, entries);
+        }
+    }
+    ::flock(m_lock_fd, LOCK_UN);
+
+    if (!ok) {
+        ::unlink(tmpSrc.c_str());
+        ::unlink(tmpBin.c_str());
+    }
+}
+
+bool CompileCache::loadTotalsLocked(uint64_t& bytes, uint64_t& entries) const {
+    Totals t{};
+    if (::pread(m_lock_fd, &t, sizeof(t), 0) != static_cast<ssize_t>(sizeof(t)) || t.magic != kTotalsMagic)
+        return false;
+    bytes = t.bytes;
+    entries = t.entries;
+    return true;
+}
+
+void CompileCache::storeTotalsLocked(uint64_t bytes, uint64_t entries) {
+    Totals t{kTotalsMagic, bytes, entries};
+    if (::pwrite(m_lock_fd, &t, sizeof(t), 0) != static_cast<ssize_t>(sizeof(t)))
+        std::cerr << "Compile cache: cannot record its size in " << m_dir << ": " << strerror(errno) << "\n";
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stats.entries = static_cast<size_t>(entries);
+    m_stats.bytes = static_cast<size_t>(bytes);
+}
+
+void CompileCache::evictLocked() {
+    struct Entry {
+        time_t mtime = 0;
+        size_t bytes = 0;
+        bool hasBin = false;
+    };
+    std::map<std::string, Entry> entries;
+    size_t total = 0;
+    time_t now = std::time(nullptr);
+
+    DIR* d = ::opendir(m_dir.c_str());
+    if (!d) return;
+    while (dirent* e = ::readdir(d)) {
+        std::string name = e->d_name;
+        std::string path = m_dir + "/" + name;
+        struct stat st{};
+        if (::stat(path.c_str(), &st) < 0) continue;
+        if (S_ISDIR(st.st_mode)) {
+            if (name.compare(0, 9, ".tmp.pch.") == 0 && staleBuildDir(name.substr(9), now - st.st_mtime)) {
+                std::error_code ec;
+                std::filesystem::remove_all(path, ec);
+            }
+            continue;
+        }
+        if (!S_ISREG(st.st_mode)) continue;
+
+        if (name[0] == '.') {
+            if ((name.compare(0, 5, ".tmp.") == 0 || name.compare(0, 5, ".run.") == 0) &&
+                now - st.st_mtime > kStaleSeconds)
+                ::unlink(path.c_str());
+            continue;
+        }
+
+        size_t dot = name.rfind('.');
+        if (dot == std::string::npos) continue;
+        std::string base = name.substr(0, dot);
+        std::string ext = name.substr(dot);
+        if (ext != ".bin" && ext != ".src") continue;
+
+        Entry& entry = entries[base];
+        entry.bytes += static_cast<size_t>(st.st_size);
+        total += static_cast<size_t>(st.st_size);
+        if (ext == ".bin") {
+            entry.hasBin = true;
+            entry.mtime = st.st_mtime;
+        } else if (!entry.hasBin) {
+            entry.mtime = st.st_mtime;
+        }
+    }
+    ::closedir(d);
+
+    std::vector<std::pair<time_t, std::string>> order;
+    order.reserve(entries.size());
+    for (const auto& e : entries) order.emplace_back(e.second.mtime, e.first);
+    std::sort(order.begin(), order.end());
+
+    uint64_t evicted = 0;
+    for (const auto& victim : order) {
+        if (total <= m_budget) break;
+        std::string base = m_dir + "/" + victim.second;
+        ::unlink((base + ".bin").c_str());
+        ::unlink((base + ".src").c_str());
+        total -= entries[victim.second].bytes;
+        ++evicted;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stats.evictions += evicted;
+    }
+    storeTotalsLocked(total, entries.size() - evicted);
+}
+
+CompileCache::Stats CompileCache::stats() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stats;
+}
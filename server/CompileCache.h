@@ -0,0 +1,75 @@
+#ifndef COMPILECACHE_H
+#define COMPILECACHE_H
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+// Compiled TRACE binaries keyed by the generated source plus the compiler
+// command, so identical snippets run without invoking g++ again.
+//
+// Entries are persistent files in a directory that survives restarts and
+// may be shared by several server processes: <key>.src holds the keyed
+// text and <key>.bin the binary. New entries are written under temporary
+// names and renamed into place, so readers never see a partial file.
+// Publishing and eviction take an flock on <dir>/.lock; lookups take no
+// lock. The lock file also holds the running size of the entries, which
+// every insert updates, so the directory is only scanned when that total
+// crosses the budget: then the least recently used entries (by binary
+// mtime, refreshed on every hit) are removed.
+class CompileCache {
+public:
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+        // As of the last insert or eviction scan by this process.
+        size_t entries = 0;
+        size_t bytes = 0;
+        size_t budget = 0;
+    };
+
+    CompileCache(size_t budgetBytes, const std::string& dir);
+    ~CompileCache();
+
+    CompileCache(const CompileCache&) = delete;
+    CompileCache& operator=(const CompileCache&) = delete;
+
+    // Returns a read-only descriptor of the cached binary, which the
+    // caller closes, or -1 on a miss. A concurrent eviction cannot pull
+    // an open binary away.
+    int find(const std::string& source, const std::string& compiler);
+    // Publishes a copy of the freshly built binary in `binaryFd`.
+    void insert(const std::string& source, const std::string& compiler, int binaryFd);
+
+    Stats stats() const;
+
+    // Names the compiler build (its version, or failing that its binary)
+    // that every key gets, so entries of an upgraded compiler are never
+    // found, whatever the command looks like. Set before the first lookup.
+    void setCompilerIdentity(const std::string& identity) { m_identity = identity; }
+
+    static uint64_t hashKey(const std::string& source, const std::string& compiler);
+
+private:
+    std::string entryPath(uint64_t key, const char* suffix) const;
+    std::string privateName(const char* kind);
+    std::string keyedCompiler(const std::string& compiler) const;
+    // Called with the directory lock held.
+    void evictLocked();
+    bool loadTotalsLocked(uint64_t& bytes, uint64_t& entries) const;
+    void storeTotalsLocked(uint64_t bytes, uint64_t entries);
+
+private:
+    size_t m_budget;
+    std::string m_dir;
+    int m_lock_fd;
+    std::string m_identity;
+
+    mutable std::mutex m_mutex;
+    uint64_t m_next_file;
+    Stats m_stats;
+};
+
+#endif
@@ -0,0 +1,63 @@
+#include "CompileFlights.h"
+#include <fcntl.h>
+#include <unistd.h>
+
+CompileFlights::Flight::~Flight() {
+    if (m_binary_fd >= 0) ::close(m_binary_fd);
+}
+
+int CompileFlights::Flight::wait(std::string& diagnostics, int& binaryFd, const std::function<bool()>& cancelled) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cv.wait(lock, [this, &cancelled]() { return m_done || (cancelled && cancelled()); });
+    binaryFd = -1;
+    if (!m_done) return -1;
+    diagnostics = m_diagnostics;
+    binaryFd = m_binary_fd >= 0 ? ::fcntl(m_binary_fd, F_DUPFD_CLOEXEC, 0) : -1;
+    return m_status == 0 && binaryFd < 0 ? -1 : m_status;
+}
+
+void CompileFlights::Flight::interrupt() {
+    { std::lock_guard<std::mutex> lock(m_mutex); }
+    m_cv.notify_all();
+}
+
+std::pair<std::shared_ptr<CompileFlights::Flight>, bool> CompileFlights::join(const std::string& source,
+                                                                              const std::string& compiler) {
+    // The full text is the key, so different sources never share a flight.
+    std::string key = compiler + '\0' + source;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_flights.find(key);
+    if (it != m_flights.end()) {
+        ++m_stats.joined;
+        return {it->second, false};
+    }
+    auto flight = std::make_shared<Flight>();
+    flight->m_key = key;
+    m_flights.emplace(std::move(key), flight);
+    ++m_stats.led;
+    return {flight, true};
+}
+
+void CompileFlights::finish(const std::shared_ptr<Flight>& flight, int status, const std::string& diagnostics,
+                            int binaryFd) {
+    {
+        // Requests arriving from now on compile (or hit the cache) anew.
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_flights.erase(flight->m_key);
+    }
+    {
+        std::lock_guard<std::mutex> lock(flight->m_mutex);
+        flight->m_status = status;
+        flight->m_diagnostics = diagnostics;
+        if (status == 0 && binaryFd >= 0) flight->m_binary_fd = ::fcntl(binaryFd, F_DUPFD_CLOEXEC, 0);
+        flight->m_done = true;
+    }
+    flight->m_cv.notify_all();
+}
+
+CompileFlights::Stats CompileFlights::stats() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Stats s = m_stats;
+    s.inFlight = m_flights.size();
+    return s;
+}
@@ -0,0 +1,68 @@
+#ifndef COMPILEFLIGHTS_H
+#define COMPILEFLIGHTS_H
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+// Single-flight compiles: while a source is being compiled with a given
+// command, later requests for the same pair wait for that compile instead
+// of starting their own g++, then share its binary and diagnostics.
+class CompileFlights {
+public:
+    struct Stats {
+        uint64_t led = 0;
+        uint64_t joined = 0;
+        size_t inFlight = 0;
+    };
+
+    // Status of a flight whose leader was cancelled; whoever waited on it
+    // joins (or leads) a new one.
+    static constexpr int kAbandoned = -2;
+
+    class Flight {
+    public:
+        ~Flight();
+        // Blocks until the leader finished, or until `cancelled` returns
+        // true after interrupt(). Returns the compiler's exit status (-1
+        // when it could not run) and, on success, a descriptor of the
+        // binary that the caller closes.
+        int wait(std::string& diagnostics, int& binaryFd, const std::function<bool()>& cancelled = nullptr);
+        // Makes a waiting wait() check its `cancelled` again.
+        void interrupt();
+
+    private:
+        friend class CompileFlights;
+        std::string m_key;
+        std::mutex m_mutex;
+        std::condition_variable m_cv;
+        bool m_done = false;
+        int m_status = -1;
+        std::string m_diagnostics;
+        int m_binary_fd = -1;
+    };
+
+    CompileFlights() = default;
+    CompileFlights(const CompileFlights&) = delete;
+    CompileFlights& operator=(const CompileFlights&) = delete;
+
+    // Joins the compile of `source` with `compiler`; the caller leads it
+    // (and must call finish()) when the bool is true.
+    std::pair<std::shared_ptr<Flight>, bool> join(const std::string& source, const std::string& compiler);
+    // Publishes the leader's result; `binaryFd` is copied, not taken over.
+    void finish(const std::shared_ptr<Flight>& flight, int status, const std::string& diagnostics, int binaryFd);
+
+    Stats stats() const;
+
+private:
+    mutable std::mutex m_mutex;
+    std::unordered_map<std::string, std::shared_ptr<Flight>> m_flights;
+    Stats m_stats;
+};
+
+#endif
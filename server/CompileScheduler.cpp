@@ -0,0 +1,115 @@
+#include "CompileScheduler.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <cstdio>
+#include <unistd.h>
+
+// What a compile of a snippet against the prelude is assumed to need
+// before any has been measured.
+static const size_t kInitialEstimate = 256 * 1024 * 1024;
+// Used when the available memory cannot be read.
+static const size_t kDefaultBudget = 1024 * 1024 * 1024;
+
+CompileScheduler::CompileScheduler(size_t slots, size_t budgetBytes)
+    : m_next_ticket(0)
+{
+    m_stats.slots = slots ? slots : ThreadPool::defaultSize();
+    if (budgetBytes == 0) {
+        // The traced programs and the server need memory too.
+        size_t available = availableMemory();
+        budgetBytes = available ? available / 4 * 3 : kDefaultBudget;
+    }
+    m_stats.budget = budgetBytes;
+    m_stats.estimate = kInitialEstimate;
+}
+
+size_t CompileScheduler::availableMemory() {
+    size_t bytes = 0;
+    if (FILE* f = std::fopen("/proc/meminfo", "r")) {
+        char line[128];
+        unsigned long long kb;
+        while (std::fgets(line, sizeof(line), f)) {
+            if (std::sscanf(line, "MemAvailable: %llu kB", &kb) == 1) {
+                bytes = static_cast<size_t>(kb) * 1024;
+                break;
+            }
+        }
+        std::fclose(f);
+    }
+    if (bytes == 0) {
+        long pages = sysconf(_SC_AVPHYS_PAGES);
+        long pageSize = sysconf(_SC_PAGESIZE);
+        if (pages > 0 && pageSize > 0) bytes = static_cast<size_t>(pages) * static_cast<size_t>(pageSize);
+    }
+    return bytes;
+}
+
+bool CompileScheduler::fitsLocked() const {
+    if (m_stats.running == 0) return true;
+    return m_stats.running < m_stats.slots && m_stats.reserved + m_stats.estimate <= m_stats.budget;
+}
+
+CompileScheduler::Ticket CompileScheduler::acquire(const std::function<bool()>& cancelled) {
+    Clock::time_point arrived = Clock::now();
+    std::unique_lock<std::mutex> lock(m_mutex);
+    uint64_t turn = m_next_ticket++;
+    m_waiting.push_back(turn);
+    ++m_stats.queueDepth;
+    if (m_stats.queueDepth > m_stats.peakDepth) m_stats.peakDepth = m_stats.queueDepth;
+    bool gaveUp = false;
+    m_cv.wait(lock, [this, turn, &cancelled, &gaveUp]() {
+        gaveUp = cancelled && cancelled();
+        return gaveUp || (m_waiting.front() == turn && fitsLocked());
+    });
+    --m_stats.queueDepth;
+
+    Ticket t;
+    if (gaveUp) {
+        m_waiting.erase(std::find(m_waiting.begin(), m_waiting.end(), turn));
+        lock.unlock();
+        // The turn may have been the one holding up the next.
+        m_cv.notify_all();
+        return t;
+    }
+    m_waiting.pop_front();
+
+    t.admitted = true;
+    t.reserved = m_stats.estimate;
+    t.waitUs = static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - arrived).count());
+    ++m_stats.running;
+    m_stats.reserved += t.reserved;
+    ++m_stats.admitted;
+    m_stats.totalWaitUs += t.waitUs;
+    if (t.waitUs > m_stats.maxWaitUs) m_stats.maxWaitUs = t.waitUs;
+    lock.unlock();
+    // The next in line may fit as well.
+    m_cv.notify_all();
+    return t;
+}
+
+void CompileScheduler::release(const Ticket& ticket, size_t peakRssBytes) {
+    if (!ticket.admitted) return;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        --m_stats.running;
+        m_stats.reserved -= ticket.reserved;
+        if (peakRssBytes > 0) {
+            if (peakRssBytes > m_stats.peakRss) m_stats.peakRss = peakRssBytes;
+            if (peakRssBytes >= m_stats.estimate) m_stats.estimate = peakRssBytes;
+            else m_stats.estimate -= (m_stats.estimate - peakRssBytes) / 8;
+        }
+    }
+    m_cv.notify_all();
+}
+
+void CompileScheduler::interrupt() {
+    // Taking the lock orders this after a waiter's last check.
+    { std::lock_guard<std::mutex> lock(m_mutex); }
+    m_cv.notify_all();
+}
+
+CompileScheduler::Stats CompileScheduler::stats() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stats;
+}
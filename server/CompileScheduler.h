@@ -0,0 +1,76 @@
+#ifndef COMPILESCHEDULER_H
+#define COMPILESCHEDULER_H
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+
+// Admits compiler runs by free cores and by a memory budget, so a burst of
+// TRACE requests cannot start more g++ instances than the machine holds.
+//
+// Every running compile reserves what a compile is currently expected to
+// need. The expectation follows the peak RSS measured for finished
+// compiles: it rises at once to a larger peak and decays slowly towards
+// smaller ones. Jobs are admitted in arrival order; one job always runs,
+// however large the estimate, so nothing waits forever.
+class CompileScheduler {
+public:
+    struct Stats {
+        size_t slots = 0;
+        size_t budget = 0;
+        size_t running = 0;
+        size_t reserved = 0;
+        size_t queueDepth = 0;
+        size_t peakDepth = 0;
+        uint64_t admitted = 0;
+        uint64_t totalWaitUs = 0;
+        uint64_t maxWaitUs = 0;
+        // Current per-job reservation and the largest peak RSS seen.
+        size_t estimate = 0;
+        size_t peakRss = 0;
+    };
+
+    struct Ticket {
+        bool admitted = false;
+        size_t reserved = 0;
+        uint64_t waitUs = 0;
+    };
+
+    // slots == 0 sizes from the number of cores, budgetBytes == 0 from the
+    // memory available when the scheduler is created.
+    explicit CompileScheduler(size_t slots = 0, size_t budgetBytes = 0);
+
+    CompileScheduler(const CompileScheduler&) = delete;
+    CompileScheduler& operator=(const CompileScheduler&) = delete;
+
+    // Blocks until the compile may start, or until `cancelled` returns true
+    // after interrupt(); the ticket is then not admitted.
+    Ticket acquire(const std::function<bool()>& cancelled = nullptr);
+    // The compile is over; `peakRssBytes` is 0 when it was not measured.
+    void release(const Ticket& ticket, size_t peakRssBytes);
+    // Makes waiting acquire() calls check their `cancelled` again.
+    void interrupt();
+
+    Stats stats() const;
+
+    static size_t availableMemory();
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    bool fitsLocked() const;
+
+private:
+    mutable std::mutex m_mutex;
+    std::condition_variable m_cv;
+    uint64_t m_next_ticket;
+    // Waiting turns in arrival order.
+    std::deque<uint64_t> m_waiting;
+    Stats m_stats;
+};
+
+#endif
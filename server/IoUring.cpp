@@ -0,0 +1,161 @@
+#include "IoUring.h"
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+static int sysSetup(unsigned entries, io_uring_params* p) {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int sysEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0));
+}
+
+static int sysRegister(int fd, unsigned opcode, void* arg, unsigned nrArgs) {
+    return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs));
+}
+
+IoUring::~IoUring() {
+    if (m_buf_ring) munmap(m_buf_ring, m_buf_ring_sz);
+    free(m_buf_base);
+    if (m_sqes) munmap(m_sqes, m_sqes_sz);
+    if (m_ring) munmap(m_ring, m_ring_sz);
+    if (m_fd >= 0) ::close(m_fd);
+}
+
+bool IoUring::init(unsigned entries) {
+    io_uring_params p{};
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;
+
+    m_fd = sysSetup(entries, &p);
+    if (m_fd < 0) return false;
+
+    // Single mmap for both rings (5.4) and fast poll for sockets (5.7)
+    // are the baseline; anything older uses the epoll loop instead.
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_FAST_POLL)) {
+        ::close(m_fd);
+        m_fd = -1;
+        errno = ENOSYS;
+        return false;
+    }
+
+    size_t sqSz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cqSz = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    m_ring_sz = sqSz > cqSz ? sqSz : cqSz;
+    m_ring = mmap(nullptr, m_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+    if (m_ring == MAP_FAILED) {
+        m_ring = nullptr;
+        return false;
+    }
+
+    m_sqes_sz = p.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(nullptr, m_sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) return false;
+    m_sqes = static_cast<io_uring_sqe*>(sqes);
+
+    char* base = static_cast<char*>(m_ring);
+    m_sq_head = reinterpret_cast<unsigned*>(base + p.sq_off.head);
+    m_sq_tail = reinterpret_cast<unsigned*>(base + p.sq_off.tail);
+    m_sq_mask = *reinterpret_cast<unsigned*>(base + p.sq_off.ring_mask);
+    m_sq_entries = *reinterpret_cast<unsigned*>(base + p.sq_off.ring_entries);
+    m_sq_array = reinterpret_cast<unsigned*>(base + p.sq_off.array);
+    m_sqe_tail = *m_sq_tail;
+
+    m_cq_head = reinterpret_cast<unsigned*>(base + p.cq_off.head);
+    m_cq_tail = reinterpret_cast<unsigned*>(base + p.cq_off.tail);
+    m_cq_mask = *reinterpret_cast<unsigned*>(base + p.cq_off.ring_mask);
+    m_cqes = reinterpret_cast<io_uring_cqe*>(base + p.cq_off.cqes);
+    return true;
+}
+
+bool IoUring::setupBufferRing(uint16_t group, unsigned count, unsigned size) {
+    if (count == 0 || (count & (count - 1)) != 0 || count > 32768) {
+        errno = EINVAL;
+        return false;
+    }
+
+    m_buf_ring_sz = count * sizeof(io_uring_buf);
+    void* ring = mmap(nullptr, m_buf_ring_sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) return false;
+    m_buf_ring = static_cast<io_uring_buf*>(ring);
+
+    io_uring_buf_reg reg{};
+    reg.ring_addr = reinterpret_cast<uint64_t>(m_buf_ring);
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (sysRegister(m_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        int err = errno;
+        munmap(m_buf_ring, m_buf_ring_sz);
+        m_buf_ring = nullptr;
+        errno = err;
+        return false;
+    }
+
+    m_buf_base = static_cast<char*>(malloc(static_cast<size_t>(count) * size));
+    if (!m_buf_base) {
+        errno = ENOMEM;
+        return false;
+    }
+    m_buf_count = count;
+    m_buf_size = size;
+    m_buf_tail = 0;
+    for (unsigned i = 0; i < count; ++i)
+        recycleBuffer(static_cast<uint16_t>(i));
+    return true;
+}
+
+void IoUring::recycleBuffer(uint16_t bid) {
+    io_uring_buf& b = m_buf_ring[m_buf_tail & (m_buf_count - 1)];
+    b.addr = reinterpret_cast<uint64_t>(buffer(bid));
+    b.len = m_buf_size;
+    b.bid = bid;
+    ++m_buf_tail;
+    // The ring tail shares storage with the first entry's resv field.
+    __atomic_store_n(&m_buf_ring[0].resv, m_buf_tail, __ATOMIC_RELEASE);
+}
+
+io_uring_sqe* IoUring::getSqe() {
+    unsigned head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+    if (m_sqe_tail - head >= m_sq_entries) return nullptr;
+
+    unsigned idx = m_sqe_tail & m_sq_mask;
+    io_uring_sqe* sqe = &m_sqes[idx];
+    std::memset(sqe, 0, sizeof(*sqe));
+    m_sq_array[idx] = idx;
+    ++m_sqe_tail;
+    return sqe;
+}
+
+unsigned IoUring::sqSpaceLeft() const {
+    return m_sq_entries - (m_sqe_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE));
+}
+
+int IoUring::submit(unsigned waitNr) {
+    // Everything between the kernel's head and our tail is still pending,
+    // including entries left over from an interrupted io_uring_enter.
+    __atomic_store_n(m_sq_tail, m_sqe_tail, __ATOMIC_RELEASE);
+    unsigned toSubmit = m_sqe_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+
+    if (toSubmit == 0 && waitNr == 0) return 0;
+    unsigned flags = waitNr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    int rc;
+    do {
+        rc = sysEnter(m_fd, toSubmit, waitNr, flags);
+    } while (rc < 0 && errno == EINTR && waitNr == 0);
+    return rc;
+}
+
+io_uring_cqe* IoUring::peekCqe() {
+    unsigned head = *m_cq_head;
+    unsigned tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail) return nullptr;
+    return &m_cqes[head & m_cq_mask];
+}
+
+void IoUring::seenCqe() {
+    __atomic_store_n(m_cq_head, *m_cq_head + 1, __ATOMIC_RELEASE);
+}
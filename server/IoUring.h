@@ -0,0 +1,69 @@
+#ifndef IOURING_H
+#define IOURING_H
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <linux/io_uring.h>
+
+// Minimal io_uring wrapper on top of the raw syscalls, so the server does
+// not need liburing. Only one thread may submit and reap.
+class IoUring {
+public:
+    IoUring() = default;
+    ~IoUring();
+
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    // Returns false (errno set) when the kernel lacks io_uring or one of
+    // the features the server relies on.
+    bool init(unsigned entries);
+    // Registers `count` buffers of `size` bytes as provided-buffer group `group`.
+    bool setupBufferRing(uint16_t group, unsigned count, unsigned size);
+
+    // Returns nullptr when the submission queue is full; call submit() first.
+    io_uring_sqe* getSqe();
+    unsigned sqSpaceLeft() const;
+    // Submits queued SQEs and waits for at least `waitNr` completions.
+    int submit(unsigned waitNr = 0);
+
+    io_uring_cqe* peekCqe();
+    void seenCqe();
+
+    char* buffer(uint16_t bid) const { return m_buf_base + static_cast<size_t>(bid) * m_buf_size; }
+    unsigned bufferSize() const noexcept { return m_buf_size; }
+    void recycleBuffer(uint16_t bid);
+
+    bool isOpen() const noexcept { return m_fd >= 0; }
+
+private:
+    int m_fd = -1;
+
+    void* m_ring = nullptr;
+    size_t m_ring_sz = 0;
+    io_uring_sqe* m_sqes = nullptr;
+    size_t m_sqes_sz = 0;
+
+    unsigned* m_sq_head = nullptr;
+    unsigned* m_sq_tail = nullptr;
+    unsigned* m_sq_array = nullptr;
+    unsigned m_sq_mask = 0;
+    unsigned m_sq_entries = 0;
+    unsigned m_sqe_tail = 0;
+
+    unsigned* m_cq_head = nullptr;
+    unsigned* m_cq_tail = nullptr;
+    unsigned m_cq_mask = 0;
+    io_uring_cqe* m_cqes = nullptr;
+
+    // Laid out as io_uring_buf_ring; its flexible array member does not
+    // have the kernel's layout when compiled as C++, so index it by hand.
+    io_uring_buf* m_buf_ring = nullptr;
+    size_t m_buf_ring_sz = 0;
+    char* m_buf_base = nullptr;
+    unsigned m_buf_count = 0;
+    unsigned m_buf_size = 0;
+    uint16_t m_buf_tail = 0;
+};
+
+#endif
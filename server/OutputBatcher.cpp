@@ -0,0 +1,158 @@
+#include "OutputBatcher.h"
+
+OutputBatcher::OutputBatcher(FlushFn fn, Limits limits, SummaryFn summary)
+    : m_flush(std::move(fn)), m_summary(std::move(summary)), m_limits(limits),
+      m_pending_bytes(0), m_writing(false), m_flush_now(false), m_broken(false),
+      m_stopping(false), m_skipped_other(0)
+{
+    m_writer = std::thread([this]() { writerLoop(); });
+}
+
+OutputBatcher::~OutputBatcher() {
+    flush();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_cv.notify_all();
+    if (m_writer.joinable()) m_writer.join();
+}
+
+void OutputBatcher::append(std::string frame, const std::string& summaryKey) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_broken) {
+        ++m_stats.dropped;
+        return;
+    }
+
+    if (m_pending_bytes >= m_limits.queueBytes) {
+        switch (m_limits.overflow) {
+        case Overflow::Block: {
+            Clock::time_point start = Clock::now();
+            m_cv.notify_one();
+            m_space_cv.wait(lock, [this]() { return m_broken || m_pending_bytes < m_limits.queueBytes; });
+            m_stats.blockedUs += static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count());
+            if (m_broken) {
+                ++m_stats.dropped;
+                return;
+            }
+            break;
+        }
+        case Overflow::Drop:
+            ++m_stats.dropped;
+            return;
+        case Overflow::Summarize:
+            if (summaryKey.empty()) {
+                ++m_skipped_other;
+                ++m_stats.dropped;
+            } else {
+                ++m_skipped[summaryKey];
+                ++m_stats.summarized;
+            }
+            return;
+        }
+    }
+
+    if (m_pending.empty()) m_oldest = Clock::now();
+    m_pending_bytes += frame.size();
+    m_pending.push_back(std::move(frame));
+    if (m_pending.size() == 1 || m_pending_bytes >= m_limits.flushBytes ||
+        m_pending_bytes >= m_limits.queueBytes)
+        m_cv.notify_one();
+}
+
+void OutputBatcher::flush() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_flush_now = true;
+    m_cv.notify_one();
+    m_idle_cv.wait(lock, [this]() {
+        return m_pending.empty() && !m_writing &&
+               (m_broken || (m_skipped.empty() && m_skipped_other == 0));
+    });
+}
+
+void OutputBatcher::cancel() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stats.dropped += m_pending.size();
+        m_pending.clear();
+        m_pending_bytes = 0;
+    }
+    m_cv.notify_all();
+    m_space_cv.notify_all();
+    m_idle_cv.notify_all();
+}
+
+OutputBatcher::Stats OutputBatcher::stats() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stats;
+}
+
+void OutputBatcher::queueSummaryLocked() {
+    if (m_summary) {
+        std::string frame = m_summary(m_skipped, m_skipped_other);
+        if (m_pending.empty()) m_oldest = Clock::now();
+        m_pending_bytes += frame.size();
+        m_pending.push_back(std::move(frame));
+    }
+    m_skipped.clear();
+    m_skipped_other = 0;
+}
+
+void OutputBatcher::writerLoop() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;) {
+        if (m_pending.empty()) {
+            bool skipped = !m_skipped.empty() || m_skipped_other > 0;
+            if (skipped && !m_broken) {
+                queueSummaryLocked();
+                continue;
+            }
+            m_skipped.clear();
+            m_skipped_other = 0;
+            m_flush_now = false;
+            m_idle_cv.notify_all();
+            if (m_stopping) return;
+            m_cv.wait(lock);
+            continue;
+        }
+
+        if (!m_flush_now && !m_stopping && m_pending_bytes < m_limits.flushBytes &&
+            m_pending_bytes < m_limits.queueBytes) {
+            Clock::time_point due = m_oldest + m_limits.maxDelay;
+            if (Clock::now() < due) {
+                m_cv.wait_until(lock, due);
+                continue;
+            }
+        }
+
+        std::vector<std::string> batch;
+        batch.swap(m_pending);
+        size_t bytes = m_pending_bytes;
+        m_pending_bytes = 0;
+        m_writing = true;
+        lock.unlock();
+        m_space_cv.notify_all();
+
+        bool ok = m_flush(batch);
+
+        lock.lock();
+        m_writing = false;
+        if (!ok) {
+            m_broken = true;
+            m_stats.dropped += batch.size() + m_pending.size();
+            m_pending.clear();
+            m_pending_bytes = 0;
+            m_space_cv.notify_all();
+            continue;
+        }
+
+        m_stats.frames += batch.size();
+        m_stats.bytes += bytes;
+        ++m_stats.flushes;
+        // A summary goes out once the client has caught up again.
+        if ((!m_skipped.empty() || m_skipped_other > 0) && m_pending_bytes < m_limits.queueBytes / 2)
+            queueSummaryLocked();
+    }
+}
@@ -0,0 +1,101 @@
+#ifndef OUTPUTBATCHER_H
+#define OUTPUTBATCHER_H
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// Collects the frames of one request and hands them to the socket in
+// batches from its own writer thread: once `flushBytes` are pending,
+// `maxDelay` after the oldest pending frame was queued, or on flush().
+// Producers never write to the socket themselves, so a slow client cannot
+// stall the tracer in the middle of the ptrace loop; what happens when the
+// pending queue reaches its limit is set by the overflow policy.
+class OutputBatcher {
+public:
+    enum class Overflow {
+        // Producers wait for the writer (memory stays bounded).
+        Block,
+        // New frames are discarded and counted.
+        Drop,
+        // Frames with a summary key are counted per key and reported in one
+        // summary frame once the queue drains; the rest are dropped.
+        Summarize
+    };
+
+    struct Limits {
+        size_t flushBytes = 64 * 1024;
+        size_t queueBytes = 1024 * 1024;
+        std::chrono::microseconds maxDelay = std::chrono::milliseconds(2);
+        Overflow overflow = Overflow::Block;
+    };
+
+    // Writes the whole batch; returns false when the connection is gone,
+    // after which everything else is discarded.
+    using FlushFn = std::function<bool(const std::vector<std::string>&)>;
+    // Encodes the summary of frames left out under Overflow::Summarize.
+    using SummaryFn = std::function<std::string(const std::map<std::string, uint64_t>& counts,
+                                                uint64_t dropped)>;
+
+    struct Stats {
+        uint64_t frames = 0;
+        uint64_t bytes = 0;
+        uint64_t flushes = 0;
+        uint64_t dropped = 0;
+        uint64_t summarized = 0;
+        uint64_t blockedUs = 0;
+    };
+
+    OutputBatcher(FlushFn fn, Limits limits, SummaryFn summary = nullptr);
+    // Flushes what is left.
+    ~OutputBatcher();
+
+    OutputBatcher(const OutputBatcher&) = delete;
+    OutputBatcher& operator=(const OutputBatcher&) = delete;
+
+    // Safe to call from several threads; frames keep their order.
+    void append(std::string frame, const std::string& summaryKey = std::string());
+    // Waits until everything appended so far has been written.
+    void flush();
+    // Discards what is pending, which lets blocked producers go. A write
+    // already under way, or stuck later, is for the FlushFn to give up.
+    void cancel();
+
+    Stats stats() const;
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    void writerLoop();
+    void queueSummaryLocked();
+
+private:
+    FlushFn m_flush;
+    SummaryFn m_summary;
+    Limits m_limits;
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::condition_variable m_space_cv;
+    std::condition_variable m_idle_cv;
+    std::vector<std::string> m_pending;
+    size_t m_pending_bytes;
+    Clock::time_point m_oldest;
+    bool m_writing;
+    bool m_flush_now;
+    bool m_broken;
+    bool m_stopping;
+    std::map<std::string, uint64_t> m_skipped;
+    uint64_t m_skipped_other;
+    Stats m_stats;
+    std::thread m_writer;
+};
+
+#endif
@@ -0,0 +1,186 @@
+#include "Process.h"
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <cstdlib>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char** environ;
+
+std::vector<std::string> splitCommand(const std::string& command) {
+    std::vector<std::string> words;
+    size_t pos = 0;
+    while (pos < command.size()) {
+        size_t start = command.find_first_not_of(' ', pos);
+        if (start == std::string::npos) break;
+        size_t end = command.find(' ', start);
+        if (end == std::string::npos) end = command.size();
+        words.push_back(command.substr(start, end - start));
+        pos = end;
+    }
+    return words;
+}
+
+std::string executableIdentity(const std::string& program) {
+    std::vector<std::string> candidates;
+    if (program.find('/') != std::string::npos) {
+        candidates.push_back(program);
+    } else if (const char* path = std::getenv("PATH")) {
+        std::string dirs = path;
+        size_t pos = 0;
+        while (pos <= dirs.size()) {
+            size_t end = dirs.find(':', pos);
+            if (end == std::string::npos) end = dirs.size();
+            std::string dir = dirs.substr(pos, end - pos);
+            candidates.push_back((dir.empty() ? "." : dir) + "/" + program);
+            pos = end + 1;
+        }
+    }
+    for (const std::string& candidate : candidates) {
+        struct stat st{};
+        if (::stat(candidate.c_str(), &st) != 0 || !S_ISREG(st.st_mode) || ::access(candidate.c_str(), X_OK) != 0)
+            continue;
+        char* real = ::realpath(candidate.c_str(), nullptr);
+        std::string name = real ? real : candidate;
+        std::free(real);
+        return name + " size=" + std::to_string(st.st_size) + " mtime=" + std::to_string(st.st_mtim.tv_sec) + "." +
+               std::to_string(st.st_mtim.tv_nsec);
+    }
+    return std::string();
+}
+
+pid_t spawnProcess(const std::vector<std::string>& args, const std::vector<std::pair<int, int>>& fds,
+                   bool newGroup) {
+    if (args.empty()) {
+        errno = EINVAL;
+        return -1;
+    }
+    std::vector<char*> argv;
+    argv.reserve(args.size() + 1);
+    for (const std::string& a : args) argv.push_back(const_cast<char*>(a.c_str()));
+    argv.push_back(nullptr);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&attr);
+
+    // A descriptor that already has its target number would keep its
+    // close-on-exec flag through dup2, so it is handed over from a copy.
+    std::vector<int> copies;
+    for (const auto& fd : fds) {
+        int from = fd.first;
+        if (from == fd.second) {
+            from = ::fcntl(fd.first, F_DUPFD_CLOEXEC, 3);
+            if (from < 0) continue;
+            copies.push_back(from);
+        }
+        posix_spawn_file_actions_adddup2(&actions, from, fd.second);
+    }
+
+    // The server ignores SIGPIPE (see Server::open()); the child gets the
+    // default back and an empty signal mask whatever thread starts it.
+    sigset_t mask;
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    sigaddset(&mask, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &mask);
+    short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+    if (newGroup) {
+        flags |= POSIX_SPAWN_SETPGROUP;
+        posix_spawnattr_setpgroup(&attr, 0);
+    }
+    posix_spawnattr_setflags(&attr, flags);
+
+    pid_t pid;
+    int err = posix_spawnp(&pid, argv[0], &actions, &attr, argv.data(), environ);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    for (int fd : copies) ::close(fd);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return pid;
+}
+
+int runProcess(const std::vector<std::string>& args, const std::string& input, std::string& output,
+               int keepFd, size_t* peakRss) {
+    return runProcess(args, input, [&output](const char* data, size_t len) { output.append(data, len); },
+                      keepFd, peakRss);
+}
+
+int runProcess(const std::vector<std::string>& args, const std::string& input,
+               const std::function<void(const char*, size_t)>& onOutput, int keepFd, size_t* peakRss,
+               const std::function<void(pid_t)>& onChild) {
+    int in[2];
+    int out[2];
+    if (pipe2(in, O_CLOEXEC) < 0) return -1;
+    if (pipe2(out, O_CLOEXEC) < 0) {
+        ::close(in[0]);
+        ::close(in[1]);
+        return -1;
+    }
+
+    std::vector<std::pair<int, int>> fds = {{in[0], STDIN_FILENO}, {out[1], STDOUT_FILENO}, {out[1], STDERR_FILENO}};
+    if (keepFd >= 0) fds.emplace_back(keepFd, keepFd);
+    pid_t pid = spawnProcess(args, fds, true);
+    ::close(in[0]);
+    ::close(out[1]);
+    if (pid < 0) {
+        ::close(in[1]);
+        ::close(out[0]);
+        return -1;
+    }
+    if (onChild) onChild(pid);
+
+    // Input and output move at the same time, so a program that writes
+    // before reading all of its input cannot block on a full pipe.
+    int flags = ::fcntl(in[1], F_GETFL, 0);
+    ::fcntl(in[1], F_SETFL, flags | O_NONBLOCK);
+    size_t written = 0;
+    if (input.empty()) {
+        ::close(in[1]);
+        in[1] = -1;
+    }
+    char buffer[4096];
+    for (;;) {
+        pollfd pfds[2] = {{out[0], POLLIN, 0}, {in[1], POLLOUT, 0}};
+        if (::poll(pfds, in[1] >= 0 ? 2 : 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (in[1] >= 0 && (pfds[1].revents & (POLLOUT | POLLERR | POLLHUP))) {
+            ssize_t n = ::write(in[1], input.data() + written, input.size() - written);
+            if (n > 0) written += static_cast<size_t>(n);
+            if ((n < 0 && errno != EAGAIN && errno != EINTR) || written == input.size()) {
+                ::close(in[1]);
+                in[1] = -1;
+            }
+        }
+        if (pfds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t n = ::read(out[0], buffer, sizeof(buffer));
+            if (n > 0) onOutput(buffer, static_cast<size_t>(n));
+            else if (n == 0 || errno != EINTR) break;
+        }
+    }
+    if (in[1] >= 0) ::close(in[1]);
+    ::close(out[0]);
+
+    // The rusage of a reaped child covers the children it reaped itself,
+    // so for g++ this is the peak of cc1plus, as or ld, not of the driver.
+    if (onChild) onChild(-1);
+    int status;
+    rusage ru{};
+    while (wait4(pid, &status, 0, &ru) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    if (peakRss) *peakRss = static_cast<size_t>(ru.ru_maxrss) * 1024;
+    return status;
+}
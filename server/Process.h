@@ -0,0 +1,45 @@
+#ifndef PROCESS_H
+#define PROCESS_H
+#pragma once
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+#include <sys/types.h>
+
+// Starting helper programs (the compiler, the snapshot host) without a
+// shell in between: argument vectors go straight to posix_spawn, which
+// creates the child with vfork semantics instead of copying the server.
+
+// Words of a command line separated by spaces. There is no quoting, so
+// the words themselves cannot contain spaces.
+std::vector<std::string> splitCommand(const std::string& command);
+
+// Names the build of `program` (looked up in PATH like spawnProcess does)
+// by its resolved path, size and modification time, for when it cannot
+// report a version. Empty when it is not found.
+std::string executableIdentity(const std::string& program);
+
+// Starts args[0], looked up in PATH. Each (from, to) pair of `fds` makes
+// the parent's `from` the child's `to`; every other descriptor the server
+// opens is close-on-exec and stays behind. With `newGroup` the child leads
+// a process group of its own. Returns the pid, or -1 with errno set.
+pid_t spawnProcess(const std::vector<std::string>& args, const std::vector<std::pair<int, int>>& fds,
+                   bool newGroup = false);
+
+// Runs args[0] with `input` on stdin and its stdout and stderr collected
+// in `output`. `keepFd` (if not -1) stays open in the child under the same
+// number. `peakRss` gets the largest resident set, in bytes, of the child
+// and of the processes it waited for. Returns the exit status as waitpid()
+// reports it, or -1 when the program could not be started.
+int runProcess(const std::vector<std::string>& args, const std::string& input, std::string& output,
+               int keepFd = -1, size_t* peakRss = nullptr);
+// Same, with the output handed to `onOutput` in chunks as it is written.
+// The child leads a process group of its own; `onChild` gets its pid once
+// it runs and -1 before it is reaped, so the group can be killed meanwhile.
+int runProcess(const std::vector<std::string>& args, const std::string& input,
+               const std::function<void(const char*, size_t)>& onOutput, int keepFd = -1,
+               size_t* peakRss = nullptr, const std::function<void(pid_t)>& onChild = nullptr);
+
+#endif
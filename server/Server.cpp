@@ -1,17 +1,47 @@
 #include "Server.h"
 #include "Tracer.h"
+#include "ThreadPool.h"
+#include "IoUring.h"
+#include "OutputBatcher.h"
+#include "CompileCache.h"
+#include "SnapshotHost.h"
+#include "CompileScheduler.h"
+#include "CompileFlights.h"
+#include "CancelToken.h"
+#include "Cgroup.h"
+#include "Process.h"
 #include <stdexcept>
+#include <algorithm>
+#include <climits>
 #include <system_error>
 #include <cerrno>
 #include <cstring>
 #include <iostream>
 #include <thread>
+#include <condition_variable>
+#include <new>
+#include <mutex>
+#include <deque>
+#include <map>
+#include <vector>
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/prctl.h>
+#include <sched.h>
 #include <csignal>
 #include <sys/wait.h>
 #include <fstream>
@@ -19,119 +49,1004 @@
 #include <cstdio>
 #include <cstdlib>
 
-Server::Server(uint16_t port, Database* database) noexcept
-    : m_port(port), m_listen_fd(-1), m_client_fd(-1), m_running(false), db(database)
+// Per-worker load counters of the pre-fork mode, in memory shared between
+// the supervisor and its workers.
+struct Server::WorkerSlot {
+    std::atomic<pid_t> pid;
+    std::atomic<uint64_t> connections;
+    std::atomic<uint64_t> accepted;
+    std::atomic<uint64_t> requests;
+    std::atomic<uint64_t> restarts;
+};
+
+struct Server::Session : std::enable_shared_from_this<Server::Session> {
+    Session(int fd, WorkerSlot* slot, bool owned = false) : fd(fd), owned(owned), slot(slot) {
+        if (slot) {
+            slot->connections.fetch_add(1, std::memory_order_relaxed);
+            slot->accepted.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    ~Session() {
+        if (owned && fd >= 0) {
+            ::shutdown(fd, SHUT_RDWR);
+            ::close(fd);
+        }
+        if (slot) slot->connections.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    int fd;
+    bool owned;
+    WorkerSlot* slot;
+    std::string code_history;
+    FrameReader reader;
+
+    // Snapshot mode: the live program and what its cells have declared.
+    std::unique_ptr<SnapshotHost> snapshot;
+    std::string cellDeclarations;
+
+    // Stateful TRACE frames waiting for the previous one of the same
+    // connection, since each builds on the code history it leaves behind.
+    std::mutex mutex;
+    std::deque<Frame> pending;
+    bool busy = false;
+    // Jobs of this connection queued or running on the pool.
+    unsigned inflight = 0;
+    // TRACE requests received and not finished yet, by request id.
+    std::unordered_map<uint32_t, std::shared_ptr<CancelToken>> requests;
+    std::condition_variable idle;
+
+    // Serializes whole frames from concurrent jobs on the socket.
+    std::mutex writeMutex;
+    // io_uring mode: bytes handed to the event loop but not yet sent, so
+    // request writers can wait for a slow client instead of queueing more.
+    // epoll mode: the size of `outbox`.
+    size_t unsent = 0;
+    bool writeClosed = false;
+    std::condition_variable drained;
+
+    // epoll mode: what the socket did not take yet, sent on EPOLLOUT by the
+    // event loop, which never blocks on a client.
+    std::string outbox;
+    bool watchingOut = false;
+
+    // io_uring mode only, owned by the event loop thread: outgoing data and
+    // the lengths of the linked SEND chain currently in flight.
+    uint64_t id = 0;
+    std::deque<std::string> outq;
+    size_t outOffset = 0;
+    std::vector<size_t> chain;
+    size_t chainDone = 0;
+    bool chainBroken = false;
+    bool sendFailed = false;
+    bool recvArmed = false;
+    bool closing = false;
+    bool closeAfterSend = false;
+};
+
+namespace {
+enum UringOp : uint8_t { OpAccept = 1, OpRecv, OpSend, OpWake, OpCancel };
+
+constexpr unsigned kUringEntries = 256;
+constexpr uint16_t kUringBufGroup = 0;
+constexpr unsigned kUringBufCount = 1024;
+constexpr unsigned kUringBufSize = 4096;
+constexpr size_t kUringMaxChain = 16;
+
+// A client that accepts no output for this long is disconnected, so it
+// cannot hold a request's writer forever.
+constexpr int kSendStallMs = 30000;
+// Request writers wait while this much is queued for a connection.
+constexpr size_t kMaxUnsent = 256 * 1024;
+// A connection with this much queued (replies it does not read, say) is
+// closed.
+constexpr size_t kMaxOutbox = 4 * 1024 * 1024;
+
+const char* const kCompiler = "g++";
+// Snapshot cells and zygote snippets are loaded into a running process.
+const char* const kSharedFlags = " -shared -fPIC";
+// The optimized tier of tiered compilation. A precompiled header is only
+// accepted with the optimization it was built with, so each tier has its own.
+const char* const kOptimizeFlags = " -O2 -march=native";
+// Background rebuilds waiting beyond this are dropped; the code keeps
+// running at the fast tier.
+constexpr size_t kRebuildQueue = 64;
+// Log lines waiting to be written beyond this are dropped.
+constexpr size_t kLogQueue = 1024;
+
+// Included ahead of every snippet. Parsing it (<iostream> above all) is most
+// of the compile time of a small snippet, so it is precompiled once.
+const char* const kPrelude =
+    "#include <iostream>\n"
+    "#include <cstdio>\n"
+    "#include <cstdlib>\n"
+    "#include <unistd.h>\n"
+    "#include <string>\n"
+    "#include <vector>\n";
+
+uint64_t uringData(uint64_t id, UringOp op) { return (id << 8) | op; }
+}
+
+// Sends never block in the kernel, even on the blocking sockets of the
+// threads mode, so a stalled client is noticed here: after `timeoutMs`
+// (ETIMEDOUT), or once `wakeFd` (a cancelled request's) is readable
+// (ECANCELED).
+static bool waitWritable(int fd, int timeoutMs, int wakeFd) {
+    pollfd pfd[2] = {{fd, POLLOUT, 0}, {wakeFd, POLLIN, 0}};
+    int rc = ::poll(pfd, wakeFd >= 0 ? 2 : 1, timeoutMs);
+    if (rc == 0) {
+        errno = ETIMEDOUT;
+        return false;
+    }
+    if (rc > 0 && wakeFd >= 0 && pfd[1].revents) {
+        errno = ECANCELED;
+        return false;
+    }
+    return rc > 0 || errno == EINTR;
+}
+
+static bool sendAll(int fd, const char* data, size_t len, int wakeFd = -1) {
+    size_t sent = 0;
+    while (sent < len) {
+        ssize_t n = ::send(fd, data + sent, len - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (!waitWritable(fd, kSendStallMs, wakeFd)) return false;
+                continue;
+            }
+            return false;
+        }
+        sent += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// Sends what the non-blocking socket takes right now. Returns the number
+// of bytes sent, or -1 on an error other than a full buffer.
+static ssize_t sendNow(int fd, const char* data, size_t len) {
+    size_t sent = 0;
+    while (sent < len) {
+        ssize_t n = ::send(fd, data + sent, len - sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        sent += static_cast<size_t>(n);
+    }
+    return static_cast<ssize_t>(sent);
+}
+
+// Like sendAll, for a batch of frames; uses as few sendmsg calls as the
+// iovec limit allows.
+static bool sendAllv(int fd, const std::vector<std::string>& parts, int timeoutMs, int wakeFd = -1) {
+    std::vector<iovec> iov;
+    iov.reserve(parts.size());
+    for (const std::string& p : parts) {
+        if (!p.empty()) iov.push_back({const_cast<char*>(p.data()), p.size()});
+    }
+
+    size_t first = 0;
+    while (first < iov.size()) {
+        msghdr msg{};
+        msg.msg_iov = &iov[first];
+        msg.msg_iovlen = std::min<size_t>(iov.size() - first, IOV_MAX);
+        ssize_t n = ::sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (!waitWritable(fd, timeoutMs, wakeFd)) return false;
+                continue;
+            }
+            return false;
+        }
+        size_t done = static_cast<size_t>(n);
+        while (first < iov.size() && done >= iov[first].iov_len) {
+            done -= iov[first].iov_len;
+            ++first;
+        }
+        if (done > 0) {
+            iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + done;
+            iov[first].iov_len -= done;
+        }
+    }
+    return true;
+}
+
+// Output is batched by the server itself, so Nagle would only delay the
+// last, partial batch of a request.
+static void setNoDelay(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+static void setCork(int fd, bool on) {
+    int v = on ? 1 : 0;
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &v, sizeof(v));
+}
+
+static bool setNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+// Runs the compiler command on `source` fed through stdin, with the binary
+// written to `binaryFd` (via /dev/fd) and diagnostics handed to
+// `onDiagnostics` as they are printed. With `stopOnError` the compiler gives
+// up after the first error; the binary of a successful build is the same,
+// so the cache key does not include it. Returns the exit status as
+// waitpid() reports it, or -1 when the compiler could not be started.
+// `peakRss` gets the largest resident set of the compiler's processes, in
+// bytes. `onChild` is told the compiler's process group while it runs.
+static int compileInMemory(const std::string& compiler, const std::string& source, int binaryFd,
+                           bool stopOnError, const std::function<void(const char*, size_t)>& onDiagnostics,
+                           size_t& peakRss, const std::function<void(pid_t)>& onChild = nullptr) {
+    std::vector<std::string> args = splitCommand(compiler);
+    if (stopOnError) args.push_back("-fmax-errors=1");
+    args.insert(args.end(), {"-pipe", "-x", "c++", "-", "-o", "/dev/fd/" + std::to_string(binaryFd)});
+    return runProcess(args, source, onDiagnostics, binaryFd, &peakRss, onChild);
+}
+
+// A private in-memory copy of the file open on `fd`, or -1.
+static int copyToMemory(int fd) {
+    struct stat st{};
+    int copy = memfd_create("trace", MFD_CLOEXEC);
+    if (copy < 0) return -1;
+    off_t offset = 0;
+    if (::fstat(fd, &st) == 0) {
+        while (offset < st.st_size) {
+            ssize_t n = ::sendfile(copy, fd, &offset, static_cast<size_t>(st.st_size - offset));
+            if (n <= 0) break;
+        }
+    }
+    if (offset < st.st_size || st.st_size == 0) {
+        ::close(copy);
+        return -1;
+    }
+    return copy;
+}
+
+static void raiseFdLimit() {
+    rlimit rl{};
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+Server::Server(uint16_t port, Database* database, IoMode mode) noexcept
+    : m_port(port), m_listen_fd(-1), m_client_fd(-1), m_running(false), db(database),
+      m_mode(mode), m_epoll_fd(-1), m_wake_fd(-1), m_next_session_id(0), m_wake_buf(0),
+      m_multishot_accept(true), m_multishot_recv(true), m_cache_budget(64 * 1024 * 1024),
+      m_cache_dir("trace_cache"), m_compile_cmd(kCompiler),
+      m_shared_compile_cmd(std::string(kCompiler) + kSharedFlags),
+      m_opt_compile_cmd(std::string(kCompiler) + kOptimizeFlags),
+      m_opt_shared_compile_cmd(std::string(kCompiler) + kSharedFlags + kOptimizeFlags),
+      m_snapshots(false), m_use_zygote(false), m_tiered(false),
+      m_compile_jobs(0), m_compile_memory(0), m_pool_threads(0), m_pool_capacity(0),
+      m_rebuilds_done(0), m_optimized_runs(0),
+      m_cancel_requests(0), m_cancels_done(0), m_cancel_us_total(0), m_cancel_us_max(0),
+      m_limit_cpu(0), m_limit_wall(0), m_limit_memory(0), m_limit_processes(0),
+      m_out_bytes(0), m_out_flushes(0), m_out_dropped(0), m_procs(0), m_pin_cpu(false), m_slots(nullptr), m_slot(nullptr), m_worker_index(0)
 {
     m_handler = [this](int client_fd, const sockaddr_in&) {
-        constexpr size_t BUF_SZ = 1024;
-        char buf[BUF_SZ];
-        std::string code_history = "";
+        constexpr size_t BUF_SZ = 64 * 1024;
+        std::unique_ptr<char[]> buf(new char[BUF_SZ]);
+        auto session = std::make_shared<Session>(client_fd, m_slot);
 
         for (;;) {
-            ssize_t r = recv(client_fd, buf, BUF_SZ - 1, 0);
+            ssize_t r = recv(client_fd, buf.get(), BUF_SZ, 0);
             if (r > 0) {
-                buf[r] = '\0';
-                std::string msg(buf);
-                
-                if (msg.rfind("TRACE ", 0) == 0) {
-                    std::string new_code = msg.substr(6);
-                    if (db) db->addLog("Tracing code snippet");
-                    
-                    auto now = std::chrono::system_clock::now();
-                    auto timestamp = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count();
-                    std::string baseName = "trace_tmp_" + std::to_string(timestamp) + "_" + std::to_string(client_fd);
-                    std::string sourceFile = baseName + ".cpp";
-                    std::string exeFile = "./" + baseName;
-
-                    std::string full_code = code_history + "\n" + new_code;
-
-                    std::ofstream out(sourceFile);
-                    out << "#include <iostream>\n"
-                        << "#include <cstdio>\n"
-                        << "#include <cstdlib>\n"
-                        << "#include <unistd.h>\n"
-                        << "#include <string>\n"
-                        << "#include <vector>\n"
-                        << "int main() {\n"
-                        << full_code << "\n"
-                        << "return 0;\n"
-                        << "}\n";
-                    out.close();
-
-                    std::string compileCmd = "g++ " + sourceFile + " -o " + baseName + " 2>&1";
-                    FILE* pipe = popen(compileCmd.c_str(), "r");
-                    if (!pipe) {
-                        std::string err = "OUT:Failed to run compiler\n";
-                        send(client_fd, err.c_str(), err.size(), 0);
-                    } else {
-                        char buffer[128];
-                        std::string result = "";
-                        while (!feof(pipe)) {
-                            if (fgets(buffer, 128, pipe) != NULL)
-                                result += buffer;
-                        }
-                        int rc = pclose(pipe);
-
-                        if (rc == 0) {
-                            code_history = full_code;
-
-                            auto sendCallback = [client_fd](const TraceEvent& evt) {
-                                std::string line = "TRACE:" + evt.type + " [" + std::to_string(evt.pid) + "]: " + evt.details + "\n";
-                                send(client_fd, line.c_str(), line.size(), 0);
-                            };
-                            
-                            
-                            std::string outputFile = baseName + ".out";
-                            std::string runCmd = exeFile + " > " + outputFile + " 2>&1";
-                            
-                            Tracer tracer(runCmd, sendCallback);
-                            tracer.run();
-
-                            std::ifstream outFile(outputFile);
-                            std::string outLine;
-                            while (std::getline(outFile, outLine)) {
-                                std::string msg = "OUT:" + outLine + "\n";
-                                send(client_fd, msg.c_str(), msg.size(), 0);
-                            }
-                            outFile.close();
-                            remove(outputFile.c_str());
-
-                        } else {
-                            std::string errMsg = "OUT:Compilation failed:\n" + result;
-                            send(client_fd, errMsg.c_str(), errMsg.size(), 0);
-                        }
-                    }
-
-                    remove(sourceFile.c_str());
-                    remove(baseName.c_str());
-                    
-                    std::string endMsg = "TRACE_END\n";
-                    send(client_fd, endMsg.c_str(), endMsg.size(), 0);
-                } else {
-                    ssize_t sent = 0;
-                    while (sent < r) {
-                        ssize_t n = send(client_fd, buf + sent, static_cast<size_t>(r - sent), 0);
-                        if (n < 0) return;
-                        sent += n;
-                    }
-                    if (db) db->addLog("Mesaj primit: " + std::string(buf, r));
-                }
+                if (!feedFrames(session, buf.get(), static_cast<size_t>(r)))
+                    break;
             } else if (r == 0) {
                 if (db) db->addLog("Client deconectat");
-                return;
+                break;
             } else {
                 if (errno == EINTR) continue;
-                return;
+                break;
             }
         }
+
+        // The socket is closed once this returns, so pipelined jobs still
+        // running on the pool must finish writing first.
+        cancelAll(*session);
+        waitIdle(*session);
     };
 
     if(db) db->addLog("Server pornit pe port " + std::to_string(port));
 }
 
+bool Server::sendTo(Session& s, const std::string& data, bool capped, CancelToken* token) {
+    if (m_mode == IoMode::Threads) {
+        std::lock_guard<std::mutex> lock(s.writeMutex);
+        if (sendAll(s.fd, data.data(), data.size(), token ? token->fd() : -1)) return true;
+        // Part of the frame may be out already.
+        if (errno == ECANCELED) ::shutdown(s.fd, SHUT_RDWR);
+        return false;
+    }
+
+    if (m_mode == IoMode::Epoll) {
+        // Called on the event loop too, so it only queues what the socket
+        // does not take at once.
+        std::lock_guard<std::mutex> lock(s.writeMutex);
+        if (s.writeClosed) return false;
+        size_t sent = 0;
+        if (s.outbox.empty()) {
+            ssize_t n = sendNow(s.fd, data.data(), data.size());
+            if (n < 0) {
+                s.writeClosed = true;
+                ::shutdown(s.fd, SHUT_RDWR);
+                return false;
+            }
+            sent = static_cast<size_t>(n);
+        }
+        if (sent == data.size()) return true;
+        if (capped && s.outbox.size() + data.size() - sent > kMaxOutbox) {
+            // Also wakes the event loop, which then drops the session.
+            s.writeClosed = true;
+            s.drained.notify_all();
+            ::shutdown(s.fd, SHUT_RDWR);
+            return false;
+        }
+        s.outbox.append(data, sent, std::string::npos);
+        s.unsent = s.outbox.size();
+        if (!s.watchingOut) {
+            epoll_event ev{};
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            ev.data.fd = s.fd;
+            epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, s.fd, &ev);
+            s.watchingOut = true;
+        }
+        return true;
+    }
+
+    // Only the event loop thread may touch the ring; it picks this up on
+    // its next iteration and batches it into linked SENDs.
+    {
+        std::lock_guard<std::mutex> lock(s.writeMutex);
+        if (s.writeClosed) return false;
+        if (capped && s.unsent + data.size() > kMaxOutbox) {
+            s.writeClosed = true;
+            s.drained.notify_all();
+            ::shutdown(s.fd, SHUT_RDWR);
+            return false;
+        }
+        s.unsent += data.size();
+    }
+    bool wake;
+    {
+        std::lock_guard<std::mutex> lock(m_out_mutex);
+        wake = m_outbound.empty();
+        m_outbound.emplace_back(s.shared_from_this(), data);
+    }
+    if (wake && m_wake_fd >= 0) {
+        uint64_t one = 1;
+        ssize_t n = ::write(m_wake_fd, &one, sizeof(one));
+        (void)n;
+    }
+    return true;
+}
+
+// Runs on a request's OutputBatcher thread, never on the tracer's.
+bool Server::sendFrames(Session& s, const std::vector<std::string>& frames, CancelToken* token) {
+    size_t bytes = 0;
+    for (const std::string& f : frames) bytes += f.size();
+
+    bool ok;
+    if (m_mode != IoMode::Threads) {
+        {
+            std::unique_lock<std::mutex> lock(s.writeMutex);
+            ok = s.drained.wait_for(lock, std::chrono::milliseconds(kSendStallMs), [&s, token]() {
+                return s.writeClosed || s.unsent < kMaxUnsent || (token && token->cancelled());
+            });
+            // Nothing of the batch went out, so the connection stays usable.
+            if (ok && token && token->cancelled() && !s.writeClosed && s.unsent >= kMaxUnsent) return false;
+            ok = ok && !s.writeClosed;
+        }
+        if (ok) {
+            // One outbound entry, and so one SEND (or one queued string),
+            // for the whole batch.
+            std::string joined;
+            joined.reserve(bytes);
+            for (const std::string& f : frames) joined += f;
+            ok = sendTo(s, joined, false);
+        }
+    } else {
+        std::lock_guard<std::mutex> lock(s.writeMutex);
+        // Beyond IOV_MAX frames the batch takes several sendmsg calls;
+        // corking keeps them from going out as a trail of small segments.
+        bool cork = frames.size() > IOV_MAX;
+        if (cork) setCork(s.fd, true);
+        ok = sendAllv(s.fd, frames, kSendStallMs, token ? token->fd() : -1);
+        if (cork) setCork(s.fd, false);
+    }
+
+    if (!ok) {
+        // Also wakes whichever loop reads this connection, which then
+        // closes it.
+        ::shutdown(s.fd, SHUT_RDWR);
+        return false;
+    }
+    m_out_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    m_out_flushes.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+// Feeds bytes read from the socket into the session's frame reader and
+// dispatches every complete frame. Returns false when the connection
+// should be closed.
+bool Server::feedFrames(const std::shared_ptr<Session>& s, const char* data, size_t len) {
+    s->reader.feed(data, len);
+    Frame frame;
+    try {
+        while (s->reader.next(frame)) {
+            if (!dispatchFrame(s, std::move(frame)))
+                return false;
+        }
+    } catch (const ProtocolError& e) {
+        sendProtocolError(*s, e);
+        return false;
+    }
+    return true;
+}
+
+// Called by the thread reading the connection, which never waits for a
+// TRACE: compiling and tracing go to the bounded pool, so a client can
+// pipeline requests and replies come back tagged with their request id
+// in whatever order they finish.
+bool Server::dispatchFrame(const std::shared_ptr<Session>& s, Frame frame) {
+    if (m_slot) m_slot->requests.fetch_add(1, std::memory_order_relaxed);
+
+    if (frame.type == MsgType::Cancel) {
+        cancelRequest(*s, frame.requestId);
+        return true;
+    }
+    if (frame.type != MsgType::Trace)
+        return handleMessage(*s, frame);
+
+    uint32_t id = frame.requestId;
+    {
+        std::lock_guard<std::mutex> lock(s->mutex);
+        s->requests[id] = std::make_shared<CancelToken>();
+    }
+    if (frame.flags & kFlagIsolated) {
+        if (!submitJob(s, [this, s, frame]() { handleTrace(*s, frame.requestId, frame.payload, frame.flags); }))
+            sendBusy(*s, id);
+        return true;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(s->mutex);
+        if (s->busy) {
+            s->pending.push_back(std::move(frame));
+            return true;
+        }
+        s->busy = true;
+    }
+    if (!submitJob(s, [this, s, frame]() { runStatefulTraces(s, frame); })) {
+        {
+            std::lock_guard<std::mutex> lock(s->mutex);
+            s->busy = false;
+        }
+        sendBusy(*s, id);
+    }
+    return true;
+}
+
+// Runs the stateful TRACE requests of one connection back to back on a
+// single worker.
+void Server::runStatefulTraces(const std::shared_ptr<Session>& s, Frame frame) {
+    for (;;) {
+        try {
+            handleTrace(*s, frame.requestId, frame.payload, frame.flags);
+        } catch (...) { }
+
+        std::lock_guard<std::mutex> lock(s->mutex);
+        if (s->pending.empty()) {
+            s->busy = false;
+            return;
+        }
+        frame = std::move(s->pending.front());
+        s->pending.pop_front();
+    }
+}
+
+bool Server::submitJob(const std::shared_ptr<Session>& s, std::function<void()> job) {
+    {
+        std::lock_guard<std::mutex> lock(s->mutex);
+        ++s->inflight;
+    }
+    bool queued = m_pool->trySubmit([s, job]() {
+        try {
+            job();
+        } catch (...) { }
+        std::lock_guard<std::mutex> lock(s->mutex);
+        if (--s->inflight == 0) s->idle.notify_all();
+    });
+    if (!queued) {
+        std::lock_guard<std::mutex> lock(s->mutex);
+        if (--s->inflight == 0) s->idle.notify_all();
+    }
+    return queued;
+}
+
+void Server::waitIdle(Session& s) {
+    std::unique_lock<std::mutex> lock(s.mutex);
+    s.idle.wait(lock, [&s]() { return s.inflight == 0; });
+}
+
+// Cancels under the session's lock, so a request either is still listed
+// and sees the cancel, or has already settled its TRACE_END without it.
+// Interruptions only kill or wake, so they are fine to run under it.
+void Server::cancelRequest(Session& s, uint32_t requestId) {
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto it = s.requests.find(requestId);
+    // A request that already finished has nothing left to stop.
+    if (it != s.requests.end() && it->second->cancel())
+        m_cancel_requests.fetch_add(1, std::memory_order_relaxed);
+}
+
+// The client is gone: nobody reads what its requests would produce.
+void Server::cancelAll(Session& s) {
+    std::lock_guard<std::mutex> lock(s.mutex);
+    for (const auto& r : s.requests) {
+        if (r.second->cancel()) m_cancel_requests.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+bool Server::handleMessage(Session& s, const Frame& msg) {
+    switch (msg.type) {
+    case MsgType::Stats:
+        return sendTo(s, encodeFrame(MsgType::Stats, msg.requestId, statsLine()));
+    case MsgType::Call:
+        if (!sendTo(s, encodeFrame(MsgType::Reply, msg.requestId, msg.payload))) return false;
+        logLater("Mesaj primit: " + msg.payload);
+        return true;
+    default:
+        return sendTo(s, encodeFrame(MsgType::Error, msg.requestId,
+                                     "unexpected message type " + std::to_string(static_cast<int>(msg.type))));
+    }
+}
+
+void Server::logLater(const std::string& message) {
+    if (!db) return;
+    if (!m_logs) {
+        db->addLog(message);
+        return;
+    }
+    m_logs->trySubmit([this, message]() { db->addLog(message); });
+}
+
+void Server::sendBusy(Session& s, uint32_t requestId) {
+    logLater("TRACE respins: coada de joburi este plina");
+    {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        s.requests.erase(requestId);
+    }
+    std::string out;
+    appendFrame(out, MsgType::Busy, requestId, "Server busy, retry later");
+    appendFrame(out, MsgType::TraceEnd, requestId);
+    sendTo(s, out);
+}
+
+void Server::sendProtocolError(Session& s, const ProtocolError& e) {
+    logLater(std::string("Eroare de protocol: ") + e.what());
+    sendTo(s, encodeFrame(MsgType::Error, 0, e.what()));
+}
+
+std::string Server::statsLine() const {
+    ThreadPool::Stats st = m_pool ? m_pool->stats() : ThreadPool::Stats{};
+    uint64_t started = st.completed + st.active;
+    uint64_t avgWaitUs = started ? st.totalWaitUs / started : 0;
+    CompileCache::Stats cs = m_cache ? m_cache->stats() : CompileCache::Stats{};
+    CompileScheduler::Stats ks = m_compiles ? m_compiles->stats() : CompileScheduler::Stats{};
+    CompileFlights::Stats fs = m_flights ? m_flights->stats() : CompileFlights::Stats{};
+    uint64_t compileWaitUs = ks.admitted ? ks.totalWaitUs / ks.admitted : 0;
+    uint64_t cancels = m_cancels_done.load();
+    uint64_t cancelUs = cancels ? m_cancel_us_total.load() / cancels : 0;
+    std::string proc = m_slot ? "process=" + std::to_string(m_worker_index) + " " : "";
+    return "STATS:" + proc + "workers=" + std::to_string(st.threads) +
+           " active=" + std::to_string(st.active) +
+           " queue_depth=" + std::to_string(st.queueDepth) +
+           " queue_peak=" + std::to_string(st.peakDepth) +
+           " queue_capacity=" + std::to_string(st.capacity) +
+           " submitted=" + std::to_string(st.submitted) +
+           " rejected=" + std::to_string(st.rejected) +
+           " completed=" + std::to_string(st.completed) +
+           " wait_avg_us=" + std::to_string(avgWaitUs) +
+           " wait_max_us=" + std::to_string(st.maxWaitUs) +
+           " out_bytes=" + std::to_string(m_out_bytes.load()) +
+           " out_flushes=" + std::to_string(m_out_flushes.load()) +
+           " out_dropped=" + std::to_string(m_out_dropped.load()) +
+           " cache_hits=" + std::to_string(cs.hits) +
+           " cache_misses=" + std::to_string(cs.misses) +
+           " cache_evictions=" + std::to_string(cs.evictions) +
+           " cache_entries=" + std::to_string(cs.entries) +
+           " cache_bytes=" + std::to_string(cs.bytes) +
+           " cache_budget=" + std::to_string(cs.budget) +
+           " rebuilds=" + std::to_string(m_rebuilds_done.load()) +
+           " optimized_runs=" + std::to_string(m_optimized_runs.load()) +
+           " compile_slots=" + std::to_string(ks.slots) +
+           " compile_running=" + std::to_string(ks.running) +
+           " compile_queue_depth=" + std::to_string(ks.queueDepth) +
+           " compile_queue_peak=" + std::to_string(ks.peakDepth) +
+           " compile_admitted=" + std::to_string(ks.admitted) +
+           " compile_wait_avg_us=" + std::to_string(compileWaitUs) +
+           " compile_wait_max_us=" + std::to_string(ks.maxWaitUs) +
+           " compile_mem_budget=" + std::to_string(ks.budget) +
+           " compile_mem_reserved=" + std::to_string(ks.reserved) +
+           " compile_mem_estimate=" + std::to_string(ks.estimate) +
+           " compile_mem_peak=" + std::to_string(ks.peakRss) +
+           " compile_led=" + std::to_string(fs.led) +
+           " compile_joined=" + std::to_string(fs.joined) +
+           " compile_in_flight=" + std::to_string(fs.inFlight) +
+           " cancels=" + std::to_string(m_cancel_requests.load()) +
+           " cancelled=" + std::to_string(cancels) +
+           " cancel_latency_avg_us=" + std::to_string(cancelUs) +
+           " cancel_latency_max_us=" + std::to_string(m_cancel_us_max.load()) +
+           " limit_cpu=" + std::to_string(m_limit_cpu.load()) +
+           " limit_wall=" + std::to_string(m_limit_wall.load()) +
+           " limit_memory=" + std::to_string(m_limit_memory.load()) +
+           " limit_processes=" + std::to_string(m_limit_processes.load());
+}
+
+void Server::setWorkerLimits(size_t threads, size_t queueCapacity) {
+    m_pool_threads = threads;
+    m_pool_capacity = queueCapacity;
+}
+
+void Server::setWorkerProcesses(unsigned count, bool pinCpu) {
+    m_procs = count;
+    m_pin_cpu = pinCpu;
+}
+
+void Server::setOutputLimits(size_t queueBytes, OutputBatcher::Overflow overflow) {
+    m_out_limits.queueBytes = queueBytes;
+    m_out_limits.overflow = overflow;
+}
+
+void Server::setCompileCache(size_t bytes, const std::string& dir) {
+    m_cache_budget = bytes;
+    m_cache_dir = dir;
+}
+
+void Server::setCompileLimits(size_t jobs, size_t memoryBytes) {
+    m_compile_jobs = jobs;
+    m_compile_memory = memoryBytes;
+}
+
+void Server::handleTrace(Session& s, uint32_t requestId, const std::string& new_code, uint8_t flags) {
+    Session* session = &s;
+    if (db) db->addLog("Tracing code snippet");
+    bool isolated = flags & kFlagIsolated;
+    std::shared_ptr<CancelToken> token;
+    {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        auto it = s.requests.find(requestId);
+        token = it != s.requests.end() ? it->second : std::make_shared<CancelToken>();
+    }
+
+    std::string full_code = isolated ? new_code : s.code_history + "\n" + new_code;
+
+    // TRACE and OUT lines go out in batches instead of one send each, from
+    // the batcher's thread, so a slow client never stalls the tracer.
+    OutputBatcher batch(
+        [this, session, &token](const std::vector<std::string>& frames) {
+            return sendFrames(*session, frames, token.get());
+        },
+        m_out_limits,
+        [requestId](const std::map<std::string, uint64_t>& counts, uint64_t dropped) {
+            std::string line = "SUMMARY: client too slow, not sent:";
+            for (const auto& c : counts)
+                line += " " + c.first + " x" + std::to_string(c.second);
+            if (dropped) line += " (" + std::to_string(dropped) + " output lines dropped)";
+            return encodeFrame(MsgType::TraceEvent, requestId, line);
+        });
+    // Whatever the request is doing, its output may be stuck behind a
+    // client that stopped reading: a cancel drops what is pending and wakes
+    // the writer, which no longer waits for room.
+    token->onCancelAlways([this, &batch, session]() {
+        batch.cancel();
+        // A threads-mode writer holds writeMutex while it waits, on the
+        // token's eventfd as well.
+        if (m_mode == IoMode::Threads) return;
+        std::lock_guard<std::mutex> lock(session->writeMutex);
+        session->drained.notify_all();
+    });
+
+    // With kFlagSequenced, TRACE and OUT lines carry their place in one
+    // order: compiler output, every stop of the tracee and every chunk of
+    // its output are numbered from the same counter.
+    bool sequenced = flags & kFlagSequenced;
+    std::atomic<uint64_t> sequence(0);
+    auto lineFrame = [requestId, sequenced](MsgType type, uint64_t seq, const std::string& text) {
+        return sequenced ? encodeFrame(type, requestId, std::to_string(seq) + " " + text, kFlagSequenced)
+                         : encodeFrame(type, requestId, text);
+    };
+    auto output = [&batch, &lineFrame, &sequence](const std::string& text) {
+        batch.append(lineFrame(MsgType::Output, sequence.fetch_add(1), text));
+    };
+
+    // Compiler and program output arrive in chunks and are forwarded line by
+    // line; a trailing partial line waits for the rest or is flushed at EOF.
+    // A line is numbered as the chunk that completed it.
+    struct PartialLine {
+        std::string text;
+        uint64_t seq = 0;
+    };
+    auto forwardLines = [&batch, &lineFrame](PartialLine& partial, const char* data, size_t len, uint64_t seq) {
+        partial.text.append(data, len);
+        partial.seq = seq;
+        size_t start = 0;
+        size_t nl;
+        while ((nl = partial.text.find('\n', start)) != std::string::npos) {
+            batch.append(lineFrame(MsgType::Output, seq, partial.text.substr(start, nl - start)));
+            start = nl + 1;
+        }
+        partial.text.erase(0, start);
+    };
+    auto flushLine = [&batch, &lineFrame](const PartialLine& partial) {
+        if (!partial.text.empty()) batch.append(lineFrame(MsgType::Output, partial.seq, partial.text));
+    };
+
+    // Snapshot mode builds only the new cell, to be loaded into the
+    // session's live program; zygote mode builds the program as a library.
+    bool snapshot = !isolated && m_snapshots && !m_host_helper.empty();
+    bool zygote = !snapshot && m_zygote;
+    SnapshotHost::Cell cell;
+    if (snapshot) cell = SnapshotHost::renderCell(s.cellDeclarations, new_code);
+    const std::string& compiler = snapshot || zygote ? m_shared_compile_cmd : m_compile_cmd;
+    const std::string& optimizer = snapshot || zygote ? m_opt_shared_compile_cmd : m_opt_compile_cmd;
+    std::string entry = zygote ? std::string("extern \"C\" int ") + SnapshotHost::kEntryPoint + "() {\n"
+                               : std::string("int main() {\n");
+    std::string body = snapshot ? cell.source :
+                       entry +
+                       full_code + "\n"
+                       "return 0;\n"
+                       "}\n";
+
+    // Without a precompiled prelude the includes go into the source itself.
+    auto sourceFor = [&body](const std::string& cmd) {
+        bool inlinePrelude = cmd.find(" -include ") == std::string::npos;
+        return (inlinePrelude ? std::string(kPrelude) : std::string()) + body;
+    };
+    std::string source = sourceFor(compiler);
+
+    // Identical source was compiled before: run that binary instead,
+    // preferring the optimized tier. Otherwise the source goes to g++ over
+    // a pipe and the binary into memory, so nothing but the cache touches
+    // the filesystem.
+    bool tiered = m_tiered && m_cache && m_rebuilds;
+    std::string optimizedSource = tiered ? sourceFor(optimizer) : std::string();
+    int binaryFd = tiered ? m_cache->find(optimizedSource, optimizer) : -1;
+    bool optimized = binaryFd >= 0;
+    if (binaryFd < 0 && m_cache) binaryFd = m_cache->find(source, compiler);
+    bool cached = binaryFd >= 0;
+    bool launched = true;
+    int rc = 0;
+    CompileScheduler::Ticket ticket;
+    Tracer::Limit limit = Tracer::Limit::None;
+
+    bool stopOnError = flags & kFlagStopOnError;
+    bool joined = false;
+
+    auto isCancelled = [&token]() { return token->cancelled(); };
+
+    if (!cached && !token->cancelled()) {
+        PartialLine partial;
+        for (;;) {
+            // The same code may be compiling for another request right now
+            // (a class submitting one exercise): then this one waits for that
+            // compile and replays its diagnostics.
+            auto flight = m_flights->join(source, stopOnError ? compiler + " -fmax-errors=1" : compiler);
+            joined = !flight.second;
+            std::string diagnostics;
+            if (joined) {
+                {
+                    CancelToken::Scope scope(*token, [&flight]() { flight.first->interrupt(); });
+                    rc = flight.first->wait(diagnostics, binaryFd, isCancelled);
+                }
+                // Its leader was cancelled: compile (or join) anew.
+                if (rc == CompileFlights::kAbandoned && !token->cancelled()) continue;
+                forwardLines(partial, diagnostics.data(), diagnostics.size(), sequence.fetch_add(1));
+                break;
+            }
+
+            binaryFd = memfd_create("trace", MFD_CLOEXEC);
+            if (binaryFd < 0) {
+                rc = -1;
+            } else {
+                {
+                    CancelToken::Scope scope(*token, [this]() { m_compiles->interrupt(); });
+                    ticket = m_compiles->acquire(isCancelled);
+                }
+                if (ticket.admitted) {
+                    // Diagnostics reach the client while g++ is still running.
+                    size_t peakRss = 0;
+                    rc = compileInMemory(compiler, source, binaryFd, stopOnError,
+                                         [&forwardLines, &partial, &diagnostics, &sequence](const char* data, size_t len) {
+                                             diagnostics.append(data, len);
+                                             forwardLines(partial, data, len, sequence.fetch_add(1));
+                                         },
+                                         peakRss,
+                                         [&token](pid_t pid) {
+                                             if (pid > 0) token->onCancel([pid]() { kill(-pid, SIGKILL); });
+                                             else token->onCancel(nullptr);
+                                         });
+                    m_compiles->release(ticket, rc == -1 ? 0 : peakRss);
+                }
+                // A build that completed anyway is still good for the others.
+                if (token->cancelled() && (rc != 0 || !ticket.admitted)) rc = CompileFlights::kAbandoned;
+            }
+            if (rc == 0 && m_cache) m_cache->insert(source, compiler, binaryFd);
+            m_flights->finish(flight.first, rc, diagnostics, binaryFd);
+            break;
+        }
+        flushLine(partial);
+        if (rc == -1) launched = false;
+    } else if (snapshot && cached) {
+        // A cell identical to an earlier one is still a new library to the
+        // dynamic loader only as a file of its own.
+        int copy = copyToMemory(binaryFd);
+        ::close(binaryFd);
+        binaryFd = copy;
+        launched = binaryFd >= 0;
+    }
+
+    if (tiered && !optimized && rc == 0 && !token->cancelled()) scheduleRebuild(optimizedSource, optimizer);
+    if (optimized) m_optimized_runs.fetch_add(1, std::memory_order_relaxed);
+
+    if (token->cancelled()) {
+        output("Cancelled");
+    } else if (!launched) {
+        output("Failed to run compiler");
+    } else if (rc == 0) {
+        auto sendCallback = [&batch, &lineFrame](const TraceEvent& evt) {
+            std::string line = evt.type + " [" + std::to_string(evt.pid) + "]: " + evt.details;
+            batch.append(lineFrame(MsgType::TraceEvent, evt.seq, line), evt.type + " " + evt.details);
+        };
+
+        // Output arrives through a pipe while the program runs.
+        PartialLine partial;
+        auto outputCallback = [&forwardLines, &partial](const char* data, size_t len, uint64_t seq) {
+            forwardLines(partial, data, len, seq);
+        };
+
+        Tracer tracer(binaryFd, sendCallback);
+        tracer.setOutputHandler(outputCallback);
+        tracer.setSequence(sequence);
+        tracer.setLimits(m_run_limits);
+        CancelToken::Scope scope(*token, [&tracer]() { tracer.cancel(); });
+        if (!snapshot && !zygote) {
+            tracer.run();
+        } else {
+            if (snapshot && !s.snapshot) {
+                s.snapshot.reset(new SnapshotHost(m_host_helper));
+                s.cellDeclarations.clear();
+            }
+            SnapshotHost& host = snapshot ? *s.snapshot : *m_zygote;
+            int out[2];
+            SnapshotHost::Child child;
+            if (pipe2(out, O_CLOEXEC) == 0) {
+                child = host.fork(binaryFd, out[1], snapshot ? SnapshotHost::Mode::Keep : SnapshotHost::Mode::Run);
+                ::close(out[1]);
+                if (child.pid < 0) ::close(out[0]);
+            }
+            bool finished = child.pid > 0 &&
+                            tracer.attach(child.pid, out[0], [&child]() { SnapshotHost::release(child); });
+
+            if (child.pid < 0 && snapshot) {
+                s.snapshot.reset();
+                output("Session state lost, starting over");
+            } else if (child.pid < 0) {
+                output("Failed to start the program");
+            } else if (finished && snapshot) {
+                // Only a cell that ran to the end moves the session forward.
+                s.snapshot->commit(child);
+                s.cellDeclarations += cell.declarations;
+                s.code_history = full_code;
+            } else if (finished) {
+                // A one-shot run that stopped itself is not kept around.
+                kill(child.pid, SIGKILL);
+            }
+        }
+
+        limit = tracer.limitHit();
+        // A cancelled run, or one stopped by a limit (an endless loop, say),
+        // would only be replayed by every later request.
+        if (!isolated && !snapshot && !token->cancelled() && limit == Tracer::Limit::None)
+            s.code_history = full_code;
+        flushLine(partial);
+        // A tripped limit is reported by TRACE_END alone, never mixed into
+        // the program's output.
+        if (token->cancelled())
+            output("Cancelled");
+        switch (limit) {
+        case Tracer::Limit::Cpu:       m_limit_cpu.fetch_add(1, std::memory_order_relaxed); break;
+        case Tracer::Limit::Wall:      m_limit_wall.fetch_add(1, std::memory_order_relaxed); break;
+        case Tracer::Limit::Memory:    m_limit_memory.fetch_add(1, std::memory_order_relaxed); break;
+        case Tracer::Limit::Processes: m_limit_processes.fetch_add(1, std::memory_order_relaxed); break;
+        case Tracer::Limit::None:      break;
+        }
+    } else {
+        output(flags & kFlagStopOnError ? "Compilation failed (stopped at the first error)" : "Compilation failed");
+    }
+
+    if (binaryFd >= 0) ::close(binaryFd);
+
+    // TRACE_END reports how much output the request produced.
+    batch.flush();
+    OutputBatcher::Stats sent = batch.stats();
+    m_out_dropped.fetch_add(sent.dropped + sent.summarized, std::memory_order_relaxed);
+
+    // From here on a CANCEL finds nothing to stop, so TRACE_END and the
+    // stats agree on whether the request was cancelled.
+    {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        s.requests.erase(requestId);
+    }
+    token->onCancelAlways(nullptr);
+    bool cancelled = token->cancelled();
+    if (cancelled) {
+        // From the cancel to the TRACE_END that confirms it.
+        uint64_t us = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+            CancelToken::Clock::now() - token->cancelledAt()).count());
+        m_cancels_done.fetch_add(1, std::memory_order_relaxed);
+        m_cancel_us_total.fetch_add(us, std::memory_order_relaxed);
+        uint64_t max = m_cancel_us_max.load(std::memory_order_relaxed);
+        while (us > max && !m_cancel_us_max.compare_exchange_weak(max, us, std::memory_order_relaxed)) {}
+    }
+
+    sendTo(s, encodeFrame(MsgType::TraceEnd, requestId,
+                          "frames=" + std::to_string(sent.frames) + " bytes=" + std::to_string(sent.bytes) +
+                          " flushes=" + std::to_string(sent.flushes) +
+                          " dropped=" + std::to_string(sent.dropped) +
+                          " summarized=" + std::to_string(sent.summarized) +
+                          " blocked_us=" + std::to_string(sent.blockedUs) +
+                          " cache=" + (cached ? "hit" : joined ? "shared" : "miss") +
+                          " tier=" + (optimized ? "optimized" : "fast") +
+                          " compile_wait_us=" + std::to_string(ticket.waitUs) +
+                          " cancelled=" + (cancelled ? "1" : "0") +
+                          " limit=" + Tracer::limitName(limit)), true, token.get());
+}
+
+
+// Queues the optimized build of `source` unless it was tried before. The
+// binary only goes into the compile cache, where the next run of the same
+// code finds it.
+void Server::scheduleRebuild(const std::string& source, const std::string& compiler) {
+    uint64_t key = CompileCache::hashKey(source, compiler);
+    {
+        std::lock_guard<std::mutex> lock(m_rebuild_mutex);
+        if (!m_rebuilt.insert(key).second) return;
+    }
+    bool queued = m_rebuilds->trySubmit([this, source, compiler]() {
+        int binaryFd = memfd_create("trace", MFD_CLOEXEC);
+        if (binaryFd < 0) return;
+        size_t peakRss = 0;
+        CompileScheduler::Ticket ticket = m_compiles->acquire();
+        int rc = compileInMemory(compiler, source, binaryFd, false, [](const char*, size_t) {}, peakRss);
+        m_compiles->release(ticket, rc == -1 ? 0 : peakRss);
+        if (rc == 0) {
+            m_cache->insert(source, compiler, binaryFd);
+            m_rebuilds_done.fetch_add(1, std::memory_order_relaxed);
+        }
+        ::close(binaryFd);
+    });
+    if (!queued) {
+        // A later run may queue it again.
+        std::lock_guard<std::mutex> lock(m_rebuild_mutex);
+        m_rebuilt.erase(key);
+    }
+}
 
 Server::~Server() {
     close();
+    if (m_pool) m_pool->shutdown();
+    if (m_rebuilds) m_rebuilds->shutdown();
+    // Last, for what the others logged; what is queued is still written.
+    if (m_logs) m_logs->shutdown();
 }
 
 Server::Server(Server&& other) noexcept
@@ -139,10 +1054,64 @@ Server::Server(Server&& other) noexcept
       m_listen_fd(other.m_listen_fd),
       m_client_fd(other.m_client_fd),
       m_running(other.m_running.load()),
-      m_handler(std::move(other.m_handler))
+      m_handler(std::move(other.m_handler)),
+      db(other.db),
+      m_mode(other.m_mode),
+      m_epoll_fd(other.m_epoll_fd),
+      m_wake_fd(other.m_wake_fd),
+      m_ring(std::move(other.m_ring)),
+      m_next_session_id(other.m_next_session_id),
+      m_wake_buf(0),
+      m_multishot_accept(other.m_multishot_accept),
+      m_multishot_recv(other.m_multishot_recv),
+      m_cache_budget(other.m_cache_budget),
+      m_cache_dir(std::move(other.m_cache_dir)),
+      m_compile_cmd(std::move(other.m_compile_cmd)),
+      m_shared_compile_cmd(std::move(other.m_shared_compile_cmd)),
+      m_opt_compile_cmd(std::move(other.m_opt_compile_cmd)),
+      m_opt_shared_compile_cmd(std::move(other.m_opt_shared_compile_cmd)),
+      m_snapshots(other.m_snapshots),
+      m_use_zygote(other.m_use_zygote),
+      m_tiered(other.m_tiered),
+      m_host_helper(std::move(other.m_host_helper)),
+      m_zygote(std::move(other.m_zygote)),
+      m_cache(std::move(other.m_cache)),
+      m_compile_jobs(other.m_compile_jobs),
+      m_compile_memory(other.m_compile_memory),
+      m_run_limits(std::move(other.m_run_limits)),
+      m_compiles(std::move(other.m_compiles)),
+      m_flights(std::move(other.m_flights)),
+      m_pool_threads(other.m_pool_threads),
+      m_pool_capacity(other.m_pool_capacity),
+      m_pool(std::move(other.m_pool)),
+      m_rebuilds(std::move(other.m_rebuilds)),
+      m_logs(std::move(other.m_logs)),
+      m_rebuilt(std::move(other.m_rebuilt)),
+      m_rebuilds_done(other.m_rebuilds_done.load()),
+      m_optimized_runs(other.m_optimized_runs.load()),
+      m_cancel_requests(other.m_cancel_requests.load()),
+      m_cancels_done(other.m_cancels_done.load()),
+      m_cancel_us_total(other.m_cancel_us_total.load()),
+      m_cancel_us_max(other.m_cancel_us_max.load()),
+      m_limit_cpu(other.m_limit_cpu.load()),
+      m_limit_wall(other.m_limit_wall.load()),
+      m_limit_memory(other.m_limit_memory.load()),
+      m_limit_processes(other.m_limit_processes.load()),
+      m_out_bytes(other.m_out_bytes.load()),
+      m_out_flushes(other.m_out_flushes.load()),
+      m_out_dropped(other.m_out_dropped.load()),
+      m_out_limits(other.m_out_limits),
+      m_procs(other.m_procs),
+      m_pin_cpu(other.m_pin_cpu),
+      m_slots(other.m_slots),
+      m_slot(other.m_slot),
+      m_worker_index(other.m_worker_index),
+      m_sessions(std::move(other.m_sessions))
 {
     other.m_listen_fd = -1;
     other.m_client_fd = -1;
+    other.m_epoll_fd = -1;
+    other.m_wake_fd = -1;
     other.m_running.store(false);
 }
 
@@ -154,9 +1123,62 @@ Server& Server::operator=(Server&& other) noexcept {
         m_client_fd = other.m_client_fd;
         m_running.store(other.m_running.load());
         m_handler = std::move(other.m_handler);
+        db = other.db;
+        m_mode = other.m_mode;
+        m_epoll_fd = other.m_epoll_fd;
+        m_wake_fd = other.m_wake_fd;
+        m_ring = std::move(other.m_ring);
+        m_next_session_id = other.m_next_session_id;
+        m_multishot_accept = other.m_multishot_accept;
+        m_multishot_recv = other.m_multishot_recv;
+        m_cache_budget = other.m_cache_budget;
+        m_cache_dir = std::move(other.m_cache_dir);
+        m_compile_cmd = std::move(other.m_compile_cmd);
+        m_shared_compile_cmd = std::move(other.m_shared_compile_cmd);
+        m_opt_compile_cmd = std::move(other.m_opt_compile_cmd);
+        m_opt_shared_compile_cmd = std::move(other.m_opt_shared_compile_cmd);
+        m_snapshots = other.m_snapshots;
+        m_use_zygote = other.m_use_zygote;
+        m_tiered = other.m_tiered;
+        m_host_helper = std::move(other.m_host_helper);
+        m_zygote = std::move(other.m_zygote);
+        m_cache = std::move(other.m_cache);
+        m_compile_jobs = other.m_compile_jobs;
+        m_compile_memory = other.m_compile_memory;
+        m_run_limits = std::move(other.m_run_limits);
+        m_compiles = std::move(other.m_compiles);
+        m_flights = std::move(other.m_flights);
+        m_pool_threads = other.m_pool_threads;
+        m_pool_capacity = other.m_pool_capacity;
+        m_pool = std::move(other.m_pool);
+        m_rebuilds = std::move(other.m_rebuilds);
+        m_logs = std::move(other.m_logs);
+        m_rebuilt = std::move(other.m_rebuilt);
+        m_rebuilds_done.store(other.m_rebuilds_done.load());
+        m_optimized_runs.store(other.m_optimized_runs.load());
+        m_cancel_requests.store(other.m_cancel_requests.load());
+        m_cancels_done.store(other.m_cancels_done.load());
+        m_cancel_us_total.store(other.m_cancel_us_total.load());
+        m_cancel_us_max.store(other.m_cancel_us_max.load());
+        m_limit_cpu.store(other.m_limit_cpu.load());
+        m_limit_wall.store(other.m_limit_wall.load());
+        m_limit_memory.store(other.m_limit_memory.load());
+        m_limit_processes.store(other.m_limit_processes.load());
+        m_out_bytes.store(other.m_out_bytes.load());
+        m_out_flushes.store(other.m_out_flushes.load());
+        m_out_dropped.store(other.m_out_dropped.load());
+        m_out_limits = other.m_out_limits;
+        m_procs = other.m_procs;
+        m_pin_cpu = other.m_pin_cpu;
+        m_slots = other.m_slots;
+        m_slot = other.m_slot;
+        m_worker_index = other.m_worker_index;
+        m_sessions = std::move(other.m_sessions);
 
         other.m_listen_fd = -1;
         other.m_client_fd = -1;
+        other.m_epoll_fd = -1;
+        other.m_wake_fd = -1;
         other.m_running.store(false);
     }
     return *this;
@@ -170,9 +1192,14 @@ void Server::ensureOpen() const {
 void Server::open() {
     if (m_listen_fd >= 0) return;
 
+    // A compiler that exits (or is killed by a cancel) while its source is
+    // still being written to it must not take the server down; the failed
+    // write reports EPIPE instead.
+    ::signal(SIGPIPE, SIG_IGN);
 
-
-    m_listen_fd = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    // Close-on-exec, like every descriptor the server opens: compilers and
+    // traced programs must not inherit sockets.
+    m_listen_fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
     if (m_listen_fd < 0) {
         throw std::system_error(errno, std::generic_category(), "socket() failed");
     }
@@ -185,6 +1212,17 @@ void Server::open() {
         throw std::system_error(err, std::generic_category(), "setsockopt(SO_REUSEADDR) failed");
     }
 
+    // Pre-fork mode: every worker binds its own socket to the same port
+    // and the kernel spreads incoming connections between them.
+    if (m_procs > 0 || m_slot) {
+        if (setsockopt(m_listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+            int err = errno;
+            ::close(m_listen_fd);
+            m_listen_fd = -1;
+            throw std::system_error(err, std::generic_category(), "setsockopt(SO_REUSEPORT) failed");
+        }
+    }
+
     sockaddr_in sa{};
     sa.sin_family = AF_INET;
     sa.sin_port = htons(m_port);
@@ -201,6 +1239,13 @@ void Server::open() {
         throw std::system_error(err, std::generic_category(), "bind() failed");
     }
 
+    // The supervisor only keeps the port bound (a socket that never listens
+    // gets no connections) and leaves accepting to its workers.
+    if (m_procs > 0) {
+        m_running.store(true);
+        return;
+    }
+
     if (listen(m_listen_fd, SOMAXCONN) < 0) {
         int err = errno;
         ::close(m_listen_fd);
@@ -208,9 +1253,121 @@ void Server::open() {
         throw std::system_error(err, std::generic_category(), "listen() failed");
     }
 
+    if (m_mode != IoMode::Threads)
+        raiseFdLimit();
+
+    if (m_mode == IoMode::Epoll) {
+        if (!setNonBlocking(m_listen_fd)) {
+            int err = errno;
+            ::close(m_listen_fd);
+            m_listen_fd = -1;
+            throw std::system_error(err, std::generic_category(), "fcntl(O_NONBLOCK) failed");
+        }
+    }
+
+    // Created after the pre-fork supervisor has forked, never before: the
+    // pool's threads would not survive fork().
+    if (!m_pool) m_pool.reset(new ThreadPool(m_pool_threads, m_pool_capacity));
+    // One rebuild at a time, so the background tier never takes more than
+    // one compile slot from requests.
+    if (m_tiered && !m_rebuilds) m_rebuilds.reset(new ThreadPool(1, kRebuildQueue));
+    if (db && !m_logs) m_logs.reset(new ThreadPool(1, kLogQueue));
+    // Pre-fork workers each open the same directory and share its entries.
+    if (!m_cache && m_cache_budget > 0)
+        m_cache.reset(new CompileCache(m_cache_budget, m_cache_dir));
+    if (!m_compiles) {
+        // Pre-fork workers split the machine between them.
+        size_t jobs = m_compile_jobs ? m_compile_jobs : ThreadPool::defaultSize();
+        size_t memory = m_compile_memory ? m_compile_memory : CompileScheduler::availableMemory() / 4 * 3;
+        if (m_procs > 1) {
+            jobs = std::max<size_t>(1, jobs / m_procs);
+            memory /= m_procs;
+        }
+        m_compiles.reset(new CompileScheduler(jobs, memory));
+    }
+    if (!m_flights) m_flights.reset(new CompileFlights());
+    if (!m_run_limits.cgroup.empty() && !Cgroup::prepare(m_run_limits.cgroup)) {
+        std::cerr << "No cgroup v2 at " << m_run_limits.cgroup << ", runs are bounded by rlimits only\n";
+        m_run_limits.cgroup.clear();
+    }
+    preparePrelude();
+    // Started on the first run, after the pre-fork workers exist.
+    if (m_use_zygote && !m_zygote && !m_host_helper.empty())
+        m_zygote.reset(new SnapshotHost(m_host_helper));
+    // A snapshot host is replaced by its own child, which this process
+    // should still be able to reap once that one is replaced in turn.
+    if (m_snapshots) prctl(PR_SET_CHILD_SUBREAPER, 1);
+
     m_running.store(true);
 }
 
+// Finds the compiler version, which names everything built for it, and
+// prepares what snippets are compiled against.
+void Server::preparePrelude() {
+    if (m_compile_cmd != kCompiler) return;
+
+    std::string version;
+    bool known = runProcess({kCompiler, "-dumpfullversion", "-dumpmachine"}, "", version) == 0;
+    // Cache keys carry the compiler even where no prelude is precompiled
+    // for it, since those commands name no version.
+    if (m_cache) m_cache->setCompilerIdentity(known ? version : executableIdentity(kCompiler));
+    if (known) {
+        m_compile_cmd = precompilePrelude(version, "");
+        if (m_tiered) m_opt_compile_cmd = precompilePrelude(version, kOptimizeFlags);
+        if (m_snapshots || m_use_zygote) {
+            m_shared_compile_cmd = precompilePrelude(version, kSharedFlags);
+            if (m_tiered)
+                m_opt_shared_compile_cmd = precompilePrelude(version, std::string(kSharedFlags) + kOptimizeFlags);
+            m_host_helper = SnapshotHost::prepare(m_cache_dir, kCompiler, version);
+        }
+    }
+    if ((m_snapshots || m_use_zygote) && m_host_helper.empty())
+        std::cerr << "Snapshot and zygote modes unavailable, running plain binaries instead\n";
+}
+
+// Builds the prelude's precompiled header for `flags`, or reuses one built
+// earlier (by this or another process) for the same compiler version,
+// flags and prelude. The directory name carries all three, so upgrading
+// g++ leads to a fresh build. Returns the command to compile snippets with.
+std::string Server::precompilePrelude(const std::string& version, const std::string& flags) {
+    std::string cmd = kCompiler + flags;
+    char name[32];
+    std::snprintf(name, sizeof(name), "/pch-%016llx",
+                  static_cast<unsigned long long>(CompileCache::hashKey(kPrelude, version + flags)));
+    std::string dir = m_cache_dir + name;
+    std::string header = dir + "/prelude.h";
+
+    ::mkdir(m_cache_dir.c_str(), 0700);
+    if (::access((header + ".gch").c_str(), R_OK) != 0) {
+        // Built aside and renamed into place, so concurrent workers never
+        // compile against a half-written header.
+        std::string tmp = m_cache_dir + "/.tmp.pch." + std::to_string(getpid());
+        ::mkdir(tmp.c_str(), 0700);
+        {
+            std::ofstream out(tmp + "/prelude.h");
+            out << kPrelude;
+        }
+        std::string output;
+        std::vector<std::string> args = splitCommand(cmd);
+        args.insert(args.end(), {"-x", "c++-header", tmp + "/prelude.h", "-o", tmp + "/prelude.h.gch"});
+        int rc = runProcess(args, "", output);
+        bool published = rc == 0 && ::rename(tmp.c_str(), dir.c_str()) == 0;
+        if (!published) {
+            ::unlink((tmp + "/prelude.h.gch").c_str());
+            ::unlink((tmp + "/prelude.h").c_str());
+            ::rmdir(tmp.c_str());
+        }
+        if (rc != 0) {
+            std::cerr << "Precompiled prelude failed, compiling it with every snippet:\n" << output;
+            return cmd;
+        }
+        if (::access((header + ".gch").c_str(), R_OK) != 0) return cmd;
+    }
+
+    if (db) db->addLog("Prelude precompilat: " + header + ".gch");
+    return cmd + " -include " + header;
+}
+
 void Server::closeClientIfOpen() {
     if (m_client_fd >= 0) {
         ::shutdown(m_client_fd, SHUT_RDWR);
@@ -221,6 +1378,11 @@ void Server::closeClientIfOpen() {
 
 void Server::close() {
     m_running.store(false);
+    if (m_wake_fd >= 0) {
+        uint64_t one = 1;
+        ssize_t n = ::write(m_wake_fd, &one, sizeof(one));
+        (void)n;
+    }
     closeClientIfOpen();
     if (m_listen_fd >= 0) {
         ::shutdown(m_listen_fd, SHUT_RDWR);
@@ -234,10 +1396,11 @@ void Server::serveOneClient() {
 
     sockaddr_in client_addr{};
     socklen_t addrlen = sizeof(client_addr);
-    m_client_fd = accept(m_listen_fd, reinterpret_cast<sockaddr*>(&client_addr), &addrlen);
+    m_client_fd = accept4(m_listen_fd, reinterpret_cast<sockaddr*>(&client_addr), &addrlen, SOCK_CLOEXEC);
     if (m_client_fd < 0) {
         throw std::system_error(errno, std::generic_category(), "accept() failed");
     }
+    setNoDelay(m_client_fd);
 
     char addrbuf[INET_ADDRSTRLEN];
     if (inet_ntop(AF_INET, &client_addr.sin_addr, addrbuf, sizeof(addrbuf)))
@@ -257,16 +1420,37 @@ void Server::serveOneClient() {
 void Server::serveForever() {
     ensureOpen();
 
+    if (m_procs > 0) {
+        superviseWorkers();
+        return;
+    }
+
+    if (m_mode == IoMode::IoUring) {
+        if (serveUring()) return;
+
+        std::cerr << "io_uring unavailable (" << strerror(errno) << "), using epoll\n";
+        if (db) db->addLog("io_uring indisponibil, se foloseste epoll");
+        if (!setNonBlocking(m_listen_fd))
+            throw std::system_error(errno, std::generic_category(), "fcntl(O_NONBLOCK) failed");
+        m_mode = IoMode::Epoll;
+    }
+
+    if (m_mode == IoMode::Epoll) {
+        serveEpoll();
+        return;
+    }
+
 while (m_running.load()) {
     sockaddr_in client_addr{};
     socklen_t addrlen = sizeof(client_addr);
     int client = -1;
     try {
-        client = accept(m_listen_fd, reinterpret_cast<sockaddr*>(&client_addr), &addrlen);
+        client = accept4(m_listen_fd, reinterpret_cast<sockaddr*>(&client_addr), &addrlen, SOCK_CLOEXEC);
         if (client < 0) {
             if (errno == EINTR) continue;
             throw std::system_error(errno, std::generic_category(), "accept() failed");
         }
+        setNoDelay(client);
     } catch (const std::exception& e) {
         std::cerr << "Accept error: " << e.what() << "\n";
         if (db) db->addLog("Accept error: " + std::string(e.what()));
@@ -284,6 +1468,575 @@ while (m_running.load()) {
 
 }
 
+void Server::serveEpoll() {
+    m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epoll_fd < 0)
+        throw std::system_error(errno, std::generic_category(), "epoll_create1() failed");
+
+    m_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_wake_fd < 0) {
+        int err = errno;
+        ::close(m_epoll_fd);
+        m_epoll_fd = -1;
+        throw std::system_error(err, std::generic_category(), "eventfd() failed");
+    }
+
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = m_listen_fd;
+    epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_listen_fd, &ev);
+    ev.events = EPOLLIN;
+    ev.data.fd = m_wake_fd;
+    epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_wake_fd, &ev);
+
+    if (db) db->addLog("Epoll event loop pornit cu " + std::to_string(m_pool->size()) + " workeri");
+
+    std::vector<epoll_event> events(256);
+    while (m_running.load()) {
+        int n = epoll_wait(m_epoll_fd, events.data(), static_cast<int>(events.size()), -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "epoll_wait error: " << strerror(errno) << "\n";
+            break;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == m_listen_fd) {
+                acceptPending();
+            } else if (fd == m_wake_fd) {
+                uint64_t v;
+                while (::read(m_wake_fd, &v, sizeof(v)) > 0) { }
+            } else {
+                auto it = m_sessions.find(fd);
+                if (it == m_sessions.end()) continue;
+                std::shared_ptr<Session> s = it->second;
+                if (events[i].events & EPOLLERR) {
+                    dropSession(fd);
+                    continue;
+                }
+                if (events[i].events & EPOLLOUT) flushOutbox(*s);
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) readSession(s);
+            }
+        }
+    }
+
+    for (auto& kv : m_sessions)
+        epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, kv.first, nullptr);
+    m_sessions.clear();
+    ::close(m_wake_fd);
+    m_wake_fd = -1;
+    ::close(m_epoll_fd);
+    m_epoll_fd = -1;
+}
+
+void Server::acceptPending() {
+    for (;;) {
+        sockaddr_in client_addr{};
+        socklen_t addrlen = sizeof(client_addr);
+        int client = accept4(m_listen_fd, reinterpret_cast<sockaddr*>(&client_addr), &addrlen,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            std::cerr << "Accept error: " << strerror(errno) << "\n";
+            logLater("Accept error: " + std::string(strerror(errno)));
+            return;
+        }
+        setNoDelay(client);
+
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = client;
+        if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, client, &ev) < 0) {
+            ::close(client);
+            continue;
+        }
+        m_sessions[client] = std::make_shared<Session>(client, m_slot, true);
+    }
+}
+
+void Server::readSession(const std::shared_ptr<Session>& s) {
+    constexpr size_t BUF_SZ = 64 * 1024;
+    static thread_local char buf[BUF_SZ];
+    bool closed = false;
+
+    for (;;) {
+        ssize_t r = recv(s->fd, buf, BUF_SZ, 0);
+        if (r > 0) {
+            if (!feedFrames(s, buf, static_cast<size_t>(r))) {
+                closed = true;
+                break;
+            }
+        } else if (r == 0) {
+            closed = true;
+            break;
+        } else {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) closed = true;
+            break;
+        }
+    }
+
+    if (closed) {
+        logLater("Client deconectat");
+        dropSession(s->fd);
+    }
+}
+
+void Server::dropSession(int fd) {
+    auto it = m_sessions.find(fd);
+    if (it == m_sessions.end()) return;
+    epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    cancelAll(*it->second);
+    {
+        // Request writers waiting for room give up.
+        std::lock_guard<std::mutex> lock(it->second->writeMutex);
+        it->second->writeClosed = true;
+        it->second->outbox.clear();
+        it->second->unsent = 0;
+    }
+    it->second->drained.notify_all();
+    m_sessions.erase(it);
+}
+
+// Sends what sendTo() queued, now that the socket takes more.
+void Server::flushOutbox(Session& s) {
+    std::lock_guard<std::mutex> lock(s.writeMutex);
+    if (s.writeClosed || s.outbox.empty()) return;
+    ssize_t n = sendNow(s.fd, s.outbox.data(), s.outbox.size());
+    if (n < 0) {
+        s.writeClosed = true;
+        s.drained.notify_all();
+        ::shutdown(s.fd, SHUT_RDWR);
+        return;
+    }
+    s.outbox.erase(0, static_cast<size_t>(n));
+    s.unsent = s.outbox.size();
+    if (s.outbox.empty()) {
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = s.fd;
+        epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, s.fd, &ev);
+        s.watchingOut = false;
+    }
+    if (s.unsent < kMaxUnsent) s.drained.notify_all();
+}
+
+bool Server::serveUring() {
+    std::unique_ptr<IoUring> ring(new IoUring());
+    if (!ring->init(kUringEntries) ||
+        !ring->setupBufferRing(kUringBufGroup, kUringBufCount, kUringBufSize))
+        return false;
+
+    // Blocking eventfd: io_uring polls it itself, and a non-blocking file
+    // would make the READ complete with -EAGAIN instead of waiting.
+    m_wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (m_wake_fd < 0) return false;
+
+    m_ring = std::move(ring);
+    if (db) db->addLog("io_uring event loop pornit cu " + std::to_string(m_pool->size()) + " workeri");
+
+    armAccept();
+    armWake();
+
+    while (m_running.load()) {
+        flushOutbound();
+        if (m_ring->submit(1) < 0 && errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+            std::cerr << "io_uring_enter error: " << strerror(errno) << "\n";
+            break;
+        }
+
+        while (io_uring_cqe* cqe = m_ring->peekCqe()) {
+            io_uring_cqe copy = *cqe;
+            m_ring->seenCqe();
+            handleCqe(copy);
+        }
+    }
+
+    m_sessions.clear();
+    m_ring.reset();
+    {
+        std::lock_guard<std::mutex> lock(m_out_mutex);
+        m_outbound.clear();
+    }
+    ::close(m_wake_fd);
+    m_wake_fd = -1;
+    return true;
+}
+
+// Returns a free SQE, flushing the queue to the kernel if it is full.
+static io_uring_sqe* nextSqe(IoUring& ring) {
+    io_uring_sqe* sqe = ring.getSqe();
+    while (!sqe) {
+        ring.submit(0);
+        sqe = ring.getSqe();
+    }
+    return sqe;
+}
+
+void Server::armAccept() {
+    io_uring_sqe* sqe = nextSqe(*m_ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = m_listen_fd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    if (m_multishot_accept) sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = uringData(0, OpAccept);
+}
+
+void Server::armRecv(Session& s) {
+    io_uring_sqe* sqe = nextSqe(*m_ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = s.fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = kUringBufGroup;
+    if (m_multishot_recv) sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = uringData(s.id, OpRecv);
+    s.recvArmed = true;
+}
+
+void Server::armWake() {
+    io_uring_sqe* sqe = nextSqe(*m_ring);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = m_wake_fd;
+    sqe->addr = reinterpret_cast<uint64_t>(&m_wake_buf);
+    sqe->len = sizeof(m_wake_buf);
+    sqe->user_data = uringData(0, OpWake);
+}
+
+void Server::flushOutbound() {
+    std::vector<std::pair<std::shared_ptr<Session>, std::string>> batch;
+    {
+        std::lock_guard<std::mutex> lock(m_out_mutex);
+        batch.swap(m_outbound);
+    }
+
+    std::vector<Session*> touched;
+    for (auto& item : batch) {
+        Session& s = *item.first;
+        if (s.closing) continue;
+        if (s.outq.empty()) touched.push_back(&s);
+        s.outq.push_back(std::move(item.second));
+    }
+    for (Session* s : touched)
+        submitSendChain(*s);
+}
+
+// Sends up to kUringMaxChain queued buffers as one linked chain so they go
+// out in order with a single io_uring_enter for all connections.
+void Server::submitSendChain(Session& s) {
+    if (!s.chain.empty() || s.outq.empty() || s.closing) return;
+
+    size_t n = std::min(s.outq.size(), kUringMaxChain);
+    if (m_ring->sqSpaceLeft() < n) m_ring->submit(0);
+
+    for (size_t i = 0; i < n; ++i) {
+        size_t offset = i == 0 ? s.outOffset : 0;
+        const std::string& buf = s.outq[i];
+
+        io_uring_sqe* sqe = nextSqe(*m_ring);
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = s.fd;
+        sqe->addr = reinterpret_cast<uint64_t>(buf.data() + offset);
+        sqe->len = static_cast<uint32_t>(buf.size() - offset);
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        if (i + 1 < n) sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = uringData(s.id, OpSend);
+        s.chain.push_back(buf.size() - offset);
+    }
+}
+
+void Server::completeSend(const std::shared_ptr<Session>& s, int res) {
+    size_t idx = s->chainDone++;
+    if (!s->chainBroken) {
+        if (res > 0) {
+            std::lock_guard<std::mutex> lock(s->writeMutex);
+            s->unsent -= std::min(s->unsent, static_cast<size_t>(res));
+            s->drained.notify_all();
+        }
+        if (res >= 0 && static_cast<size_t>(res) == s->chain[idx]) {
+            s->outq.pop_front();
+            s->outOffset = 0;
+        } else if (res >= 0) {
+            // Short send breaks the link; the rest come back -ECANCELED and
+            // are resent from the new offset.
+            s->outOffset += static_cast<size_t>(res);
+            s->chainBroken = true;
+        } else {
+            if (res != -ECANCELED) s->sendFailed = true;
+            s->chainBroken = true;
+        }
+    }
+
+    if (s->chainDone < s->chain.size()) return;
+    s->chain.clear();
+    s->chainDone = 0;
+    s->chainBroken = false;
+
+    if (s->sendFailed) {
+        closeUringSession(s);
+        return;
+    }
+    if (s->closing) {
+        releaseUringSession(s);
+        return;
+    }
+    submitSendChain(*s);
+    if (s->closeAfterSend && s->chain.empty()) closeUringSession(s);
+}
+
+void Server::closeUringSession(const std::shared_ptr<Session>& s) {
+    if (!s->closing) {
+        s->closing = true;
+        cancelAll(*s);
+        s->outq.clear();
+        {
+            std::lock_guard<std::mutex> lock(s->writeMutex);
+            s->writeClosed = true;
+            s->unsent = 0;
+        }
+        s->drained.notify_all();
+        if (s->recvArmed) {
+            io_uring_sqe* sqe = nextSqe(*m_ring);
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = uringData(s->id, OpRecv);
+            sqe->user_data = uringData(s->id, OpCancel);
+        }
+    }
+    releaseUringSession(s);
+}
+
+void Server::closeUringSessionAfterSend(const std::shared_ptr<Session>& s) {
+    // What the reader queued last is still in m_outbound.
+    flushOutbound();
+    if (s->closing || s->chain.empty()) {
+        closeUringSession(s);
+        return;
+    }
+    if (s->closeAfterSend) return;
+    s->closeAfterSend = true;
+    cancelAll(*s);
+    {
+        std::lock_guard<std::mutex> lock(s->writeMutex);
+        s->writeClosed = true;
+    }
+    s->drained.notify_all();
+    if (s->recvArmed) {
+        io_uring_sqe* sqe = nextSqe(*m_ring);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = uringData(s->id, OpRecv);
+        sqe->user_data = uringData(s->id, OpCancel);
+    }
+}
+
+// The kernel may still reference the socket and the send buffers, so the
+// session is only forgotten once nothing is in flight.
+void Server::releaseUringSession(const std::shared_ptr<Session>& s) {
+    if (s->closing && s->chain.empty() && !s->recvArmed)
+        m_sessions.erase(s->id);
+}
+
+void Server::handleCqe(const io_uring_cqe& cqe) {
+    uint64_t id = cqe.user_data >> 8;
+    int res = cqe.res;
+    bool more = cqe.flags & IORING_CQE_F_MORE;
+
+    switch (static_cast<UringOp>(cqe.user_data & 0xff)) {
+    case OpAccept: {
+        if (res >= 0) {
+            setNoDelay(res);
+            auto s = std::make_shared<Session>(res, m_slot, true);
+            s->id = ++m_next_session_id;
+            m_sessions[s->id] = s;
+            armRecv(*s);
+        } else if (res == -EINVAL && m_multishot_accept) {
+            m_multishot_accept = false;
+        } else {
+            std::cerr << "Accept error: " << strerror(-res) << "\n";
+            logLater("Accept error: " + std::string(strerror(-res)));
+        }
+        if (!more && m_running.load()) armAccept();
+        break;
+    }
+    case OpRecv: {
+        auto it = m_sessions.find(id);
+        std::shared_ptr<Session> s = it != m_sessions.end() ? it->second : nullptr;
+        if (cqe.flags & IORING_CQE_F_BUFFER) {
+            uint16_t bid = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+            bool ok = true;
+            if (s && res > 0 && !s->closing && !s->closeAfterSend)
+                ok = feedFrames(s, m_ring->buffer(bid), static_cast<size_t>(res));
+            m_ring->recycleBuffer(bid);
+            if (!ok) {
+                if (!more) s->recvArmed = false;
+                closeUringSessionAfterSend(s);
+                break;
+            }
+        }
+        if (!s) break;
+        if (!more) s->recvArmed = false;
+
+        if (s->closing) {
+            releaseUringSession(s);
+        } else if (s->closeAfterSend) {
+            // Reading has stopped; the last SEND closes the session.
+        } else if (res > 0) {
+            if (!more) armRecv(*s);
+        } else if (res == -ENOBUFS) {
+            if (!more) armRecv(*s);
+        } else if (res == -EINVAL && m_multishot_recv) {
+            // Kernel without multishot recv: re-arm one shot at a time.
+            m_multishot_recv = false;
+            armRecv(*s);
+        } else {
+            if (res == 0) logLater("Client deconectat");
+            closeUringSession(s);
+        }
+        break;
+    }
+    case OpSend: {
+        auto it = m_sessions.find(id);
+        if (it != m_sessions.end()) completeSend(it->second, res);
+        break;
+    }
+    case OpWake:
+        if (m_running.load()) armWake();
+        break;
+    case OpCancel:
+        break;
+    }
+}
+
+void Server::superviseWorkers() {
+    using Clock = std::chrono::steady_clock;
+    const unsigned n = m_procs;
+
+    void* mem = mmap(nullptr, sizeof(WorkerSlot) * n, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        throw std::system_error(errno, std::generic_category(), "mmap() failed");
+    m_slots = static_cast<WorkerSlot*>(mem);
+    for (unsigned i = 0; i < n; ++i)
+        new (&m_slots[i]) WorkerSlot{{0}, {0}, {0}, {0}, {0}};
+
+    std::vector<Clock::time_point> started(n);
+    for (unsigned i = 0; i < n; ++i) {
+        spawnWorker(i);
+        started[i] = Clock::now();
+    }
+    if (db) db->addLog("Supervizor pornit cu " + std::to_string(n) + " procese worker");
+
+    auto lastReport = Clock::now();
+    while (m_running.load()) {
+        int status = 0;
+        pid_t pid = waitpid(-1, &status, WNOHANG);
+        if (pid > 0) {
+            for (unsigned i = 0; i < n; ++i) {
+                if (m_slots[i].pid.load() != pid) continue;
+
+                std::string why = WIFSIGNALED(status)
+                    ? "killed by signal " + std::to_string(WTERMSIG(status))
+                    : "exited with status " + std::to_string(WEXITSTATUS(status));
+                std::cerr << "Worker " << i << " (pid " << pid << ") " << why << ", restarting\n";
+                if (db) db->addLog("Worker " + std::to_string(i) + " " + why);
+
+                m_slots[i].connections.store(0);
+                m_slots[i].restarts.fetch_add(1);
+                // A worker that dies right after start would otherwise be
+                // re-forked in a tight loop.
+                if (Clock::now() - started[i] < std::chrono::seconds(1))
+                    std::this_thread::sleep_for(std::chrono::seconds(1));
+                spawnWorker(i);
+                started[i] = Clock::now();
+                break;
+            }
+            continue;
+        }
+
+        if (Clock::now() - lastReport >= std::chrono::seconds(10)) {
+            reportWorkerLoad();
+            lastReport = Clock::now();
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    }
+
+    for (unsigned i = 0; i < n; ++i) {
+        pid_t pid = m_slots[i].pid.load();
+        if (pid > 0) ::kill(pid, SIGTERM);
+    }
+    for (unsigned i = 0; i < n; ++i) {
+        pid_t pid = m_slots[i].pid.load();
+        if (pid > 0) waitpid(pid, nullptr, 0);
+    }
+    munmap(m_slots, sizeof(WorkerSlot) * n);
+    m_slots = nullptr;
+}
+
+void Server::spawnWorker(unsigned index) {
+    pid_t parent = getpid();
+    std::cout.flush();
+    std::cerr.flush();
+    pid_t pid = fork();
+    if (pid < 0) {
+        std::cerr << "fork() failed for worker " << index << ": " << strerror(errno) << "\n";
+        return;
+    }
+    if (pid > 0) {
+        m_slots[index].pid.store(pid);
+        return;
+    }
+
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != parent) _exit(0);
+
+    ::close(m_listen_fd);
+    m_listen_fd = -1;
+    m_procs = 0;
+    m_slot = &m_slots[index];
+    m_worker_index = index;
+
+    if (m_pin_cpu) {
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0 && CPU_COUNT(&allowed) > 0) {
+            int target = static_cast<int>(index % static_cast<unsigned>(CPU_COUNT(&allowed)));
+            for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+                if (!CPU_ISSET(cpu, &allowed) || target-- > 0) continue;
+                cpu_set_t one;
+                CPU_ZERO(&one);
+                CPU_SET(cpu, &one);
+                sched_setaffinity(0, sizeof(one), &one);
+                break;
+            }
+        }
+    }
+
+    // Each worker keeps its own log file; a shared one would be rewritten
+    // from several stale in-memory copies.
+    if (db) db->reopen(db->workerFilename(index));
+
+    try {
+        open();
+        serveForever();
+    } catch (const std::exception& e) {
+        std::cerr << "Worker " << index << " error: " << e.what() << "\n";
+        _exit(1);
+    }
+    _exit(0);
+}
+
+void Server::reportWorkerLoad() {
+    for (unsigned i = 0; i < m_procs; ++i) {
+        const WorkerSlot& w = m_slots[i];
+        std::cout << "worker " << i << " pid=" << w.pid.load()
+                  << " connections=" << w.connections.load()
+                  << " accepted=" << w.accepted.load()
+                  << " requests=" << w.requests.load()
+                  << " restarts=" << w.restarts.load() << "\n";
+    }
+    std::cout.flush();
+}
+
 void Server::setupSignalHandler() {
     struct sigaction sa;
     sa.sa_handler = [](int) {
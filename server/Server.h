@@ -4,17 +4,42 @@
 #include <cstdint>
 #include <functional>
 #include <atomic>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <mutex>
 #include "tinyxml2.h"
 using namespace tinyxml2;
 #include "Database.h"
+#include "Protocol.h"
+#include "OutputBatcher.h"
+#include "Tracer.h"
 
 struct sockaddr_in;
+class ThreadPool;
+class CompileCache;
+class SnapshotHost;
+class CompileScheduler;
+class CompileFlights;
+class CancelToken;
+class IoUring;
+struct io_uring_cqe;
 
 class Server {
 public:
     using ClientHandler = std::function<void(int, const sockaddr_in&)>;
 
-    explicit Server(uint16_t port = 12345, Database* database = nullptr) noexcept;
+    enum class IoMode {
+        Threads,
+        Epoll,
+        // Falls back to Epoll when the kernel lacks the required features.
+        IoUring
+    };
+
+    explicit Server(uint16_t port = 12345, Database* database = nullptr,
+                    IoMode mode = IoMode::Threads) noexcept;
     ~Server();
 
     Server(const Server&) = delete;
@@ -33,13 +58,111 @@ public:
 
     void setClientHandler(ClientHandler h) { m_handler = std::move(h); }
 
+    // Size of the worker pool that runs TRACE jobs and of its admission
+    // queue (0 = derive from the core count). Must be called before open().
+    void setWorkerLimits(size_t threads, size_t queueCapacity);
+
+    // Pre-fork mode: serveForever() forks `count` worker processes, each
+    // with its own SO_REUSEPORT listener, and restarts them when they die.
+    // Must be called before open().
+    void setWorkerProcesses(unsigned count, bool pinCpu = false);
+
+    // Bound on the TRACE/OUT frames a request may have waiting for a slow
+    // client, and what happens beyond it. Must be called before open().
+    void setOutputLimits(size_t queueBytes, OutputBatcher::Overflow overflow);
+
+    // Directory and size budget of the cache of compiled TRACE binaries
+    // (0 disables it). The directory persists across restarts and may be
+    // shared by several servers. Must be called before open().
+    void setCompileCache(size_t bytes, const std::string& dir = "trace_cache");
+
+    // How many compiles may run at once and how much memory they may take
+    // together (0 = derive from the cores and the available memory).
+    // Must be called before open().
+    void setCompileLimits(size_t jobs, size_t memoryBytes);
+
+    // Snapshot mode: each connection keeps its program alive between
+    // stateful TRACE requests and runs only the new code on top of it,
+    // instead of replaying the whole history. Must be called before open().
+    void setSnapshots(bool enabled) { m_snapshots = enabled; }
+
+    // Zygote mode: snippets are built as shared objects and run in children
+    // forked from a warm process, instead of exec'ing a fresh binary (under
+    // /bin/sh) each time. Must be called before open().
+    void setZygote(bool enabled) { m_use_zygote = enabled; }
+
+    // Tiered compilation: new code is built quickly without optimization and
+    // rebuilt in the background at -O2 -march=native; later runs of the same
+    // code use the optimized binary from the compile cache. Must be called
+    // before open().
+    void setTiered(bool enabled) { m_tiered = enabled; }
+
+    // Bounds on each traced run: CPU seconds, address space, live processes
+    // and wall-clock time, and optionally a cgroup v2 per run under
+    // `limits.cgroup`. A run that hits one is killed and its TRACE_END says
+    // which. Must be called before open().
+    void setRunLimits(const Tracer::Limits& limits) { m_run_limits = limits; }
+
     bool isOpen() const noexcept { return m_listen_fd >= 0; }
     uint16_t port() const noexcept { return m_port; }
+    IoMode ioMode() const noexcept { return m_mode; }
 
 private:
+    struct Session;
+    struct WorkerSlot;
+
     void setupSignalHandler();
     void ensureOpen() const;
-    void closeClientIfOpen(); 
+    void closeClientIfOpen();
+
+    // In epoll and io_uring mode a `capped` send closes a connection that
+    // lets too much pile up; writers that waited for room are not capped.
+    // A send for a request stops waiting for room once `token` is
+    // cancelled (closing the connection if that cut a frame short).
+    bool sendTo(Session& s, const std::string& data, bool capped = true, CancelToken* token = nullptr);
+    bool sendFrames(Session& s, const std::vector<std::string>& frames, CancelToken* token = nullptr);
+    bool feedFrames(const std::shared_ptr<Session>& s, const char* data, size_t len);
+    bool dispatchFrame(const std::shared_ptr<Session>& s, Frame frame);
+    void runStatefulTraces(const std::shared_ptr<Session>& s, Frame frame);
+    bool submitJob(const std::shared_ptr<Session>& s, std::function<void()> job);
+    void waitIdle(Session& s);
+    void cancelRequest(Session& s, uint32_t requestId);
+    void cancelAll(Session& s);
+    bool handleMessage(Session& s, const Frame& msg);
+    void handleTrace(Session& s, uint32_t requestId, const std::string& new_code, uint8_t flags);
+    void scheduleRebuild(const std::string& source, const std::string& compiler);
+    // Database::addLog rewrites the whole file, so the event loops leave it
+    // to a thread of its own. Dropped when that falls far behind.
+    void logLater(const std::string& message);
+    void sendBusy(Session& s, uint32_t requestId);
+    void sendProtocolError(Session& s, const ProtocolError& e);
+    std::string statsLine() const;
+    void preparePrelude();
+    std::string precompilePrelude(const std::string& version, const std::string& flags);
+
+    void serveEpoll();
+    void acceptPending();
+    void readSession(const std::shared_ptr<Session>& s);
+    void dropSession(int fd);
+    void flushOutbox(Session& s);
+
+    void superviseWorkers();
+    void spawnWorker(unsigned index);
+    void reportWorkerLoad();
+
+    bool serveUring();
+    void armAccept();
+    void armRecv(Session& s);
+    void armWake();
+    void flushOutbound();
+    void submitSendChain(Session& s);
+    void completeSend(const std::shared_ptr<Session>& s, int res);
+    void closeUringSession(const std::shared_ptr<Session>& s);
+    // Stops reading and closes once what is queued, such as the Error frame
+    // of a protocol error, has gone out.
+    void closeUringSessionAfterSend(const std::shared_ptr<Session>& s);
+    void releaseUringSession(const std::shared_ptr<Session>& s);
+    void handleCqe(const io_uring_cqe& cqe);
 
 private:
     uint16_t m_port;
@@ -48,6 +171,74 @@ private:
     std::atomic<bool> m_running;
     ClientHandler m_handler;
     Database* db;
+
+    IoMode m_mode;
+    int m_epoll_fd;
+    int m_wake_fd;
+    std::unique_ptr<IoUring> m_ring;
+    uint64_t m_next_session_id;
+    uint64_t m_wake_buf;
+    bool m_multishot_accept;
+    bool m_multishot_recv;
+    std::mutex m_out_mutex;
+    std::vector<std::pair<std::shared_ptr<Session>, std::string>> m_outbound;
+    size_t m_cache_budget;
+    std::string m_cache_dir;
+    // Compiler command every snippet is built with; names the precompiled
+    // prelude when one could be built.
+    std::string m_compile_cmd;
+    // The same for the shared objects of snapshot and zygote mode.
+    std::string m_shared_compile_cmd;
+    // Optimized tier of both, when tiered compilation is on.
+    std::string m_opt_compile_cmd;
+    std::string m_opt_shared_compile_cmd;
+    bool m_snapshots;
+    bool m_use_zygote;
+    bool m_tiered;
+    // Path of the host helper; empty while neither mode is on.
+    std::string m_host_helper;
+    std::unique_ptr<SnapshotHost> m_zygote;
+    std::unique_ptr<CompileCache> m_cache;
+    size_t m_compile_jobs;
+    size_t m_compile_memory;
+    Tracer::Limits m_run_limits;
+    std::unique_ptr<CompileScheduler> m_compiles;
+    std::unique_ptr<CompileFlights> m_flights;
+    size_t m_pool_threads;
+    size_t m_pool_capacity;
+    std::unique_ptr<ThreadPool> m_pool;
+    // Background rebuilds at the optimized tier, and the cache keys they
+    // were started for (each is tried once per process).
+    std::unique_ptr<ThreadPool> m_rebuilds;
+    std::unique_ptr<ThreadPool> m_logs;
+    std::mutex m_rebuild_mutex;
+    std::unordered_set<uint64_t> m_rebuilt;
+    std::atomic<uint64_t> m_rebuilds_done;
+    std::atomic<uint64_t> m_optimized_runs;
+    // CANCEL frames and disconnects that cancelled a request, the requests
+    // that ended cancelled, and the time from cancel to their TRACE_END.
+    std::atomic<uint64_t> m_cancel_requests;
+    std::atomic<uint64_t> m_cancels_done;
+    std::atomic<uint64_t> m_cancel_us_total;
+    std::atomic<uint64_t> m_cancel_us_max;
+    // Runs ended by each of the run limits.
+    std::atomic<uint64_t> m_limit_cpu;
+    std::atomic<uint64_t> m_limit_wall;
+    std::atomic<uint64_t> m_limit_memory;
+    std::atomic<uint64_t> m_limit_processes;
+    // Totals of the batched TRACE output written to clients.
+    std::atomic<uint64_t> m_out_bytes;
+    std::atomic<uint64_t> m_out_flushes;
+    std::atomic<uint64_t> m_out_dropped;
+    OutputBatcher::Limits m_out_limits;
+
+    unsigned m_procs;
+    bool m_pin_cpu;
+    WorkerSlot* m_slots;
+    WorkerSlot* m_slot;
+    unsigned m_worker_index;
+    // Keyed by fd in epoll mode and by session id in io_uring mode.
+    std::unordered_map<uint64_t, std::shared_ptr<Session>> m_sessions;
 };
 
 #endif
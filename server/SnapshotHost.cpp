@@ -0,0 +1,402 @@
+#include "SnapshotHost.h"
+#include "CompileCache.h"
+#include "Process.h"
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+
+// How long the host may take to report the child it forked.
+constexpr int kForkReplyMs = 5000;
+
+// The helper program. It takes the control socket as argv[1]. Each message
+// is a mode letter and carries three fds: where output goes, a private
+// channel on which the forked child reports its pid and then waits for one
+// message, and the library to load.
+const char* const kHelperSource = R"(#include <dlfcn.h>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+int main(int argc, char** argv) {
+    int ctl = argc > 1 ? atoi(argv[1]) : 3;
+    int devnull = open("/dev/null", O_RDWR);
+    dup2(devnull, 0);
+    dup2(devnull, 1);
+    dup2(devnull, 2);
+    // Pulls libstdc++ in, so one-shot runs find it loaded and initialized.
+    std::ios_base::sync_with_stdio(true);
+    // One-shot runs are not waited for; the kernel reaps them.
+    signal(SIGCHLD, SIG_IGN);
+    for (;;) {
+        char request[16];
+        char control[CMSG_SPACE(3 * sizeof(int))];
+        iovec iov{request, sizeof(request)};
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t n = recvmsg(ctl, &msg, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        int fds[3] = {-1, -1, -1};
+        cmsghdr* c = CMSG_FIRSTHDR(&msg);
+        if (c && c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS &&
+            c->cmsg_len == CMSG_LEN(sizeof(fds)))
+            memcpy(fds, CMSG_DATA(c), sizeof(fds));
+        int out = fds[0];
+        int chan = fds[1];
+        int lib = fds[2];
+        bool keep = request[0] == 'K';
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            signal(SIGCHLD, SIG_DFL);
+            setpgid(0, 0);
+            char buf[16];
+            int len = snprintf(buf, sizeof(buf), "%d", (int)getpid());
+            if (send(chan, buf, len, 0) < 0 || recv(chan, buf, sizeof(buf), 0) <= 0) _exit(1);
+            close(chan);
+            if (!keep) close(ctl);
+            dup2(out, 1);
+            dup2(out, 2);
+            close(out);
+            // The library's fd stays open, so no later cell gets its number
+            // and with it the name the loader knows this library by.
+            char path[32];
+            snprintf(path, sizeof(path), "/proc/self/fd/%d", lib);
+            void* handle = dlopen(path, RTLD_NOW | RTLD_GLOBAL);
+            if (!handle) {
+                fprintf(stderr, "%s\n", dlerror());
+                _exit(1);
+            }
+            if (!keep) {
+                int (*entry)() = (int (*)())dlsym(handle, "pso_main");
+                exit(entry ? entry() : 1);
+            }
+            fflush(stdout);
+            fflush(stderr);
+            dup2(devnull, 1);
+            dup2(devnull, 2);
+            // Tells the tracer the cell is done; from here on this process
+            // is the snapshot and serves the next message.
+            raise(SIGSTOP);
+            continue;
+        }
+        if (pid < 0) send(chan, "-1", 2, 0);
+        if (out >= 0) close(out);
+        if (chan >= 0) close(chan);
+        if (lib >= 0) close(lib);
+        if (keep && pid > 0)
+            while (waitpid(pid, nullptr, 0) < 0 && errno == EINTR) { }
+    }
+}
+)";
+
+// Position just past the whitespace starting at `i`.
+size_t skipSpace(const std::string& s, size_t i) {
+    while (i < s.size() && std::isspace(static_cast<unsigned char>(s[i]))) ++i;
+    return i;
+}
+
+bool isIdentChar(char c) {
+    return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+}
+
+// The identifier starting at `i` (empty if there is none).
+std::string wordAt(const std::string& s, size_t i) {
+    size_t end = i;
+    while (end < s.size() && isIdentChar(s[end])) ++end;
+    return s.substr(i, end - i);
+}
+
+bool isOneOf(const std::string& word, std::initializer_list<const char*> words) {
+    for (const char* w : words)
+        if (word == w) return true;
+    return false;
+}
+
+// Splits a cell into top-level statements with comments removed.
+// Preprocessor lines are kept whole.
+std::vector<std::string> splitStatements(const std::string& code) {
+    std::vector<std::string> out;
+    std::string cur;
+    int depth = 0;
+    auto finish = [&]() {
+        size_t b = skipSpace(cur, 0);
+        size_t e = cur.size();
+        while (e > b && std::isspace(static_cast<unsigned char>(cur[e - 1]))) --e;
+        if (e > b) out.push_back(cur.substr(b, e - b));
+        cur.clear();
+    };
+    // An `else` or `catch` continues the statement just closed.
+    auto continues = [&code](size_t i) {
+        std::string next = wordAt(code, skipSpace(code, i));
+        return next == "else" || next == "catch";
+    };
+
+    size_t i = 0;
+    while (i < code.size()) {
+        char c = code[i];
+        if (c == '#' && depth == 0 && skipSpace(cur, 0) == cur.size()) {
+            size_t nl = code.find('\n', i);
+            if (nl == std::string::npos) nl = code.size();
+            cur = code.substr(i, nl - i);
+            finish();
+            i = nl;
+        } else if (c == '/' && i + 1 < code.size() && code[i + 1] == '/') {
+            i = code.find('\n', i);
+            if (i == std::string::npos) i = code.size();
+        } else if (c == '/' && i + 1 < code.size() && code[i + 1] == '*') {
+            size_t end = code.find("*/", i + 2);
+            i = end == std::string::npos ? code.size() : end + 2;
+            cur += ' ';
+        } else if (c == '"' || c == '\'') {
+            size_t j = i + 1;
+            while (j < code.size() && code[j] != c) j += code[j] == '\\' ? 2 : 1;
+            j = std::min(j + 1, code.size());
+            cur.append(code, i, j - i);
+            i = j;
+        } else {
+            cur += c;
+            ++i;
+            if (c == '(' || c == '[' || c == '{') {
+                ++depth;
+            } else if (c == ')' || c == ']' || c == '}') {
+                if (depth > 0) --depth;
+                // Blocks and control statements end with their closing
+                // brace; everything else (a struct, a lambda) with ';'.
+                if (c == '}' && depth == 0 && !continues(i)) {
+                    size_t b = skipSpace(cur, 0);
+                    std::string first = wordAt(cur, b);
+                    if (cur[b] == '{' ||
+                        isOneOf(first, {"if", "for", "while", "switch", "try", "namespace"}))
+                        finish();
+                }
+            } else if (c == ';' && depth == 0 && !continues(i)) {
+                finish();
+            }
+        }
+    }
+    finish();
+    return out;
+}
+
+// Whether a statement declares variables: two or more names (the type and
+// the declarator) before an initializer or the end of the declaration.
+bool declaresVariables(const std::string& stmt) {
+    unsigned names = 0;
+    size_t i = 0;
+    for (;;) {
+        i = skipSpace(stmt, i);
+        if (i >= stmt.size()) return false;
+        char c = stmt[i];
+        if (isIdentChar(c) || (c == ':' && i + 1 < stmt.size() && stmt[i + 1] == ':')) {
+            size_t start = i;
+            while (i < stmt.size() &&
+                   (isIdentChar(stmt[i]) || (stmt[i] == ':' && i + 1 < stmt.size() && stmt[i + 1] == ':')))
+                i += stmt[i] == ':' ? 2 : 1;
+            std::string word = stmt.substr(start, i - start);
+            if (!isOneOf(word, {"const", "volatile", "static", "constexpr", "inline", "thread_local"}))
+                ++names;
+            // Template arguments, but not a shift.
+            size_t j = skipSpace(stmt, i);
+            if (j < stmt.size() && stmt[j] == '<' && j + 1 < stmt.size() && stmt[j + 1] != '<' &&
+                stmt[j + 1] != '=') {
+                int angle = 0;
+                for (; j < stmt.size(); ++j) {
+                    if (stmt[j] == '<') ++angle;
+                    else if (stmt[j] == '>' && --angle == 0) break;
+                    else if (stmt[j] == ';') return false;
+                }
+                i = j + 1;
+            }
+        } else if (c == '*' || c == '&') {
+            ++i;
+        } else {
+            return names >= 2 && (c == '=' || c == ';' || c == '{' || c == '[' || c == '(' || c == ',');
+        }
+    }
+}
+
+}
+
+SnapshotHost::Cell SnapshotHost::renderCell(const std::string& declarations, const std::string& code) {
+    Cell cell;
+    std::string body;
+    unsigned step = 0;
+    for (const std::string& stmt : splitStatements(code)) {
+        std::string first = wordAt(stmt, 0);
+        std::string text = stmt;
+        if (text.back() != ';' && text.back() != '}' && text[0] != '#') text += ';';
+
+        if (text[0] == '#' ||
+            isOneOf(first, {"using", "typedef", "struct", "class", "enum", "union", "namespace", "template",
+                            "static_assert", "extern"})) {
+            cell.declarations += text + "\n";
+            body += text + "\n";
+        } else if (!isOneOf(first, {"if", "for", "while", "do", "switch", "return", "break", "continue",
+                                    "goto", "try", "throw", "delete", "case", "default", "else"}) &&
+                   text[0] != '{' && declaresVariables(text)) {
+            // Inline, so every later cell can repeat the declaration and
+            // still refer to this one object.
+            if (first == "static") text.erase(0, 6);
+            std::string decl = (first == "inline" ? "" : "inline ") + text + "\n";
+            cell.declarations += decl;
+            body += decl;
+        } else {
+            body += "static const bool pso_step_" + std::to_string(step++) + " = ([]() {\n" + text +
+                    "\n}(), true);\n";
+        }
+    }
+    cell.source = declarations + body;
+    return cell;
+}
+
+std::string SnapshotHost::prepare(const std::string& dir, const std::string& compiler,
+                                  const std::string& version) {
+    char name[40];
+    std::snprintf(name, sizeof(name), "/snapshot-host-%016llx",
+                  static_cast<unsigned long long>(CompileCache::hashKey(kHelperSource, version)));
+    std::string path = dir + name;
+    ::mkdir(dir.c_str(), 0700);
+    if (::access(path.c_str(), X_OK) == 0) return path;
+
+    std::string tmp = dir + "/.tmp.host." + std::to_string(getpid());
+    {
+        std::ofstream out(tmp + ".cpp");
+        out << kHelperSource;
+    }
+    std::vector<std::string> args = splitCommand(compiler);
+    args.insert(args.end(), {"-O2", tmp + ".cpp", "-o", tmp, "-ldl"});
+    std::string output;
+    int rc = runProcess(args, "", output);
+    ::unlink((tmp + ".cpp").c_str());
+    if (rc != 0 || ::rename(tmp.c_str(), path.c_str()) != 0) {
+        ::unlink(tmp.c_str());
+        std::cerr << "Snapshot host could not be built:\n" << output;
+        return std::string();
+    }
+    return path;
+}
+
+SnapshotHost::Child::~Child() {
+    if (channel >= 0) ::close(channel);
+}
+
+SnapshotHost::SnapshotHost(const std::string& helper)
+    : m_helper(helper), m_ctl(-1), m_pid(0), m_committed(false) {}
+
+SnapshotHost::~SnapshotHost() {
+    stop();
+}
+
+bool SnapshotHost::start() {
+    int sv[2];
+    if (::socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) return false;
+    pid_t pid = spawnProcess({m_helper, "3"}, {{sv[1], 3}}, true);
+    ::close(sv[1]);
+    if (pid < 0) {
+        ::close(sv[0]);
+        return false;
+    }
+    m_ctl = sv[0];
+    m_pid = pid;
+    return true;
+}
+
+void SnapshotHost::stop() {
+    if (m_ctl >= 0) ::close(m_ctl);
+    m_ctl = -1;
+    if (m_pid > 0) {
+        ::kill(m_pid, SIGKILL);
+        ::waitpid(m_pid, nullptr, 0);
+    }
+    m_pid = -1;
+}
+
+SnapshotHost::Child SnapshotHost::fork(int libraryFd, int outFd, Mode mode) {
+    Child child;
+    int chan[2];
+    if (::socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, chan) < 0) return child;
+
+    char request = mode == Mode::Keep ? 'K' : 'R';
+    int fds[3] = {outFd, chan[1], libraryFd};
+    char control[CMSG_SPACE(sizeof(fds))] = {};
+    iovec iov{&request, 1};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsghdr* c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(fds));
+    std::memcpy(CMSG_DATA(c), fds, sizeof(fds));
+
+    bool sent;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        // Losing a host that never held committed state loses nothing.
+        if (m_pid < 0 && !m_committed) m_pid = 0;
+        if (m_pid == 0 && !start()) m_pid = -1;
+        sent = m_pid > 0 && ::sendmsg(m_ctl, &msg, MSG_NOSIGNAL) >= 0;
+        if (!sent) stop();
+    }
+    ::close(chan[1]);
+
+    char reply[16] = {};
+    pollfd pfd{chan[0], POLLIN, 0};
+    if (sent && ::poll(&pfd, 1, kForkReplyMs) == 1 && ::recv(chan[0], reply, sizeof(reply) - 1, 0) > 0)
+        child.pid = static_cast<pid_t>(std::atoi(reply));
+    if (child.pid > 0) {
+        child.channel = chan[0];
+    } else {
+        child.pid = -1;
+        ::close(chan[0]);
+    }
+    return child;
+}
+
+bool SnapshotHost::release(Child& child) {
+    bool ok = ::send(child.channel, "go", 2, MSG_NOSIGNAL) == 2;
+    ::close(child.channel);
+    child.channel = -1;
+    return ok;
+}
+
+void SnapshotHost::commit(const Child& child) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    // The old snapshot is blocked waiting for this child; nothing else
+    // needs it now. The server is a subreaper, so orphaned hosts are
+    // still its children to reap.
+    if (m_pid > 0) {
+        ::kill(m_pid, SIGKILL);
+        ::waitpid(m_pid, nullptr, 0);
+    }
+    m_pid = child.pid;
+    m_committed = true;
+}
@@ -0,0 +1,96 @@
+#ifndef SNAPSHOTHOST_H
+#define SNAPSHOTHOST_H
+#pragma once
+#include <mutex>
+#include <string>
+#include <utility>
+#include <sys/types.h>
+
+// Keeps a session's program alive between TRACE cells, so a cell runs on
+// top of the state the previous ones left instead of replaying them.
+//
+// Cells are compiled as shared objects whose top-level declarations become
+// inline globals and whose statements run, in order, as static
+// initializers. The host is a small helper process holding every cell
+// loaded so far. For each new cell it forks; the child loads the cell under
+// the tracer and, if it gets to the end, stops itself and replaces the host
+// as the session's snapshot. A cell that fails or crashes leaves the
+// previous snapshot in place.
+//
+// A host nobody commits to is a zygote: a warm process with libstdc++
+// loaded that forks a child per one-shot run, which loads a snippet, calls
+// its entry point and exits. Requests may come from several threads.
+class SnapshotHost {
+public:
+    enum class Mode {
+        // The library is a cell; the child may become the snapshot.
+        Keep,
+        // The library exports kEntryPoint; the child exits with its result.
+        Run
+    };
+
+    static constexpr const char* kEntryPoint = "pso_main";
+
+    struct Cell {
+        // Translation unit for the shared object (without the prelude).
+        std::string source;
+        // Namespace-scope part of the cell that later cells repeat.
+        std::string declarations;
+    };
+
+    // `declarations` is what the earlier cells declared.
+    static Cell renderCell(const std::string& declarations, const std::string& code);
+
+    // Builds the helper program into `dir`, or reuses one built earlier for
+    // the same compiler. Returns its path, or an empty string on failure.
+    static std::string prepare(const std::string& dir, const std::string& compiler,
+                               const std::string& version);
+
+    explicit SnapshotHost(const std::string& helper);
+    ~SnapshotHost();
+
+    SnapshotHost(const SnapshotHost&) = delete;
+    SnapshotHost& operator=(const SnapshotHost&) = delete;
+
+    // A forked child waiting to be released, and the private channel it
+    // waits on.
+    struct Child {
+        pid_t pid = -1;
+        int channel = -1;
+
+        Child() = default;
+        Child(Child&& other) noexcept : pid(other.pid), channel(other.channel) { other.channel = -1; }
+        Child& operator=(Child&& other) noexcept {
+            std::swap(pid, other.pid);
+            std::swap(channel, other.channel);
+            return *this;
+        }
+        ~Child();
+    };
+
+    // Forks the host into a child that will load the library open on
+    // `libraryFd`, with stdout and stderr on `outFd`. The child waits for
+    // release(), so a tracer can attach first. The pid is -1 when that
+    // failed; a host that held committed state is not started again.
+    //
+    // The dynamic loader hands back an already loaded library for a file
+    // it has seen before, so a cell must come in a file of its own.
+    Child fork(int libraryFd, int outFd, Mode mode);
+    // Lets a child returned by fork() run.
+    static bool release(Child& child);
+    // The child reached the end of its cell: it becomes the snapshot.
+    void commit(const Child& child);
+
+private:
+    bool start();
+    void stop();
+
+private:
+    std::string m_helper;
+    std::mutex m_mutex;
+    int m_ctl;
+    pid_t m_pid;
+    bool m_committed;
+};
+
+#endif
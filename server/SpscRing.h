@@ -0,0 +1,68 @@
+#ifndef SPSCRING_H
+#define SPSCRING_H
+#pragma once
+#include <cstddef>
+#include <atomic>
+#include <memory>
+#include <type_traits>
+
+// Bounded lock-free queue for exactly one producer thread and one consumer
+// thread. Capacity is rounded up to a power of two.
+template <typename T>
+class SpscRing {
+    static_assert(std::is_trivially_copyable<T>::value, "SpscRing holds plain records");
+
+public:
+    explicit SpscRing(size_t capacity) {
+        size_t n = 2;
+        while (n < capacity) n <<= 1;
+        m_mask = n - 1;
+        m_slots.reset(new T[n]);
+    }
+
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    // Producer only. Returns false when the ring is full.
+    bool tryPush(const T& item) {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_head_cache > m_mask) {
+            m_head_cache = m_head.load(std::memory_order_acquire);
+            if (tail - m_head_cache > m_mask) return false;
+        }
+        m_slots[tail & m_mask] = item;
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only. Returns false when the ring is empty.
+    bool tryPop(T& item) {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tail_cache) {
+            m_tail_cache = m_tail.load(std::memory_order_acquire);
+            if (head == m_tail_cache) return false;
+        }
+        item = m_slots[head & m_mask];
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const {
+        return m_head.load(std::memory_order_acquire) == m_tail.load(std::memory_order_acquire);
+    }
+
+    size_t capacity() const noexcept { return m_mask + 1; }
+
+private:
+    std::unique_ptr<T[]> m_slots;
+    size_t m_mask = 0;
+
+    // Each index sits on its own cache line next to the copy of the other
+    // index its owner last saw, so the two threads rarely share a line.
+    alignas(64) std::atomic<size_t> m_head{0};
+    size_t m_tail_cache = 0;
+    alignas(64) std::atomic<size_t> m_tail{0};
+    size_t m_head_cache = 0;
+};
+
+#endif
@@ -0,0 +1,98 @@
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(size_t threads, size_t capacity)
+    : m_capacity(capacity), m_stopping(false)
+{
+    if (threads == 0) threads = defaultSize();
+    if (m_capacity == 0) m_capacity = threads * 4;
+    m_workers.reserve(threads);
+    for (size_t i = 0; i < threads; ++i)
+        m_workers.emplace_back([this]() { workerLoop(); });
+}
+
+ThreadPool::~ThreadPool() {
+    shutdown();
+}
+
+size_t ThreadPool::defaultSize() {
+    unsigned int n = std::thread::hardware_concurrency();
+    return n > 0 ? n : 2;
+}
+
+void ThreadPool::submit(Job job) {
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_space_cv.wait(lock, [this]() { return m_stopping || m_queue.size() < m_capacity; });
+        if (m_stopping) return;
+        m_queue.push_back({std::move(job), Clock::now()});
+        ++m_stats.submitted;
+        if (m_queue.size() > m_stats.peakDepth) m_stats.peakDepth = m_queue.size();
+    }
+    m_cv.notify_one();
+}
+
+bool ThreadPool::trySubmit(Job job) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_stopping || m_queue.size() >= m_capacity) {
+            ++m_stats.rejected;
+            return false;
+        }
+        m_queue.push_back({std::move(job), Clock::now()});
+        ++m_stats.submitted;
+        if (m_queue.size() > m_stats.peakDepth) m_stats.peakDepth = m_queue.size();
+    }
+    m_cv.notify_one();
+    return true;
+}
+
+void ThreadPool::shutdown() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_stopping) return;
+        m_stopping = true;
+    }
+    m_cv.notify_all();
+    m_space_cv.notify_all();
+    for (auto& t : m_workers) {
+        if (t.joinable()) t.join();
+    }
+}
+
+ThreadPool::Stats ThreadPool::stats() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Stats s = m_stats;
+    s.threads = m_workers.size();
+    s.capacity = m_capacity;
+    s.queueDepth = m_queue.size();
+    return s;
+}
+
+void ThreadPool::workerLoop() {
+    for (;;) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait(lock, [this]() { return m_stopping || !m_queue.empty(); });
+            if (m_queue.empty()) return;
+            Entry e = std::move(m_queue.front());
+            m_queue.pop_front();
+            job = std::move(e.job);
+
+            uint64_t waited = static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - e.enqueued).count());
+            m_stats.totalWaitUs += waited;
+            if (waited > m_stats.maxWaitUs) m_stats.maxWaitUs = waited;
+            ++m_stats.active;
+        }
+        m_space_cv.notify_one();
+
+        try {
+            job();
+        } catch (...) { }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        --m_stats.active;
+        ++m_stats.completed;
+    }
+}
@@ -0,0 +1,72 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <chrono>
+#include <functional>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+class ThreadPool {
+public:
+    using Job = std::function<void()>;
+
+    struct Stats {
+        size_t threads = 0;
+        size_t capacity = 0;
+        size_t queueDepth = 0;
+        size_t peakDepth = 0;
+        size_t active = 0;
+        uint64_t submitted = 0;
+        uint64_t rejected = 0;
+        uint64_t completed = 0;
+        uint64_t totalWaitUs = 0;
+        uint64_t maxWaitUs = 0;
+    };
+
+    // threads == 0 sizes the pool from the number of cores,
+    // capacity == 0 bounds the queue at 4 jobs per thread.
+    explicit ThreadPool(size_t threads = 0, size_t capacity = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Blocks while the queue is full.
+    void submit(Job job);
+    // Returns false instead of queueing when the queue is full.
+    bool trySubmit(Job job);
+    void shutdown();
+
+    size_t size() const noexcept { return m_workers.size(); }
+    size_t capacity() const noexcept { return m_capacity; }
+    Stats stats() const;
+
+    static size_t defaultSize();
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Entry {
+        Job job;
+        Clock::time_point enqueued;
+    };
+
+    void workerLoop();
+
+private:
+    std::vector<std::thread> m_workers;
+    std::deque<Entry> m_queue;
+    size_t m_capacity;
+    mutable std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::condition_variable m_space_cv;
+    bool m_stopping;
+    Stats m_stats;
+};
+
+#endif
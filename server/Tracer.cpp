@@ -1,88 +1,437 @@
 #include "Tracer.h"
+#include "Cgroup.h"
+#include <sched.h>
 #include <sys/ptrace.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
 #include <sys/user.h>
 #include <sys/syscall.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <csignal>
+#include <thread>
+#include <chrono>
+#include <cstddef>
 #include <iostream>
 #include <cstring>
 #include <sstream>
 #include <map>
+#include <memory>
 
-Tracer::Tracer(const std::string& command, EventHandler handler)
-    : m_command(command), m_handler(handler) {}
+Tracer::Tracer(const std::vector<std::string>& args, EventHandler handler)
+    : m_args(args), m_program_fd(-1), m_pid(0), m_cancelled(false), m_limit(Limit::None),
+      m_memory_denied(false), m_handler(handler), m_own_seq(0), m_seq(&m_own_seq), m_records(8192),
+      m_tracing_done(false), m_sender_idle(false), m_producer_blocked(false), m_traced(false) {}
+
+Tracer::Tracer(int programFd, EventHandler handler)
+    : m_program_fd(programFd), m_pid(0), m_cancelled(false), m_limit(Limit::None),
+      m_memory_denied(false), m_handler(handler), m_own_seq(0), m_seq(&m_own_seq), m_records(8192),
+      m_tracing_done(false), m_sender_idle(false), m_producer_blocked(false), m_traced(false) {}
+
+Tracer::~Tracer() = default;
+
+const char* Tracer::limitName(Limit limit) {
+    switch (limit) {
+    case Limit::None:      return "none";
+    case Limit::Cpu:       return "cpu";
+    case Limit::Wall:      return "wall";
+    case Limit::Memory:    return "memory";
+    case Limit::Processes: return "processes";
+    }
+    return "none";
+}
+
+// The tracee is created with vfork semantics: it borrows the server's
+// address space until exec instead of copying its page tables, so starting
+// a run costs the same however large the server has grown.
+static const size_t kLaunchStackSize = 64 * 1024;
+
+struct Launch {
+    int programFd;
+    int outputFd;
+    char** argv;
+    sigset_t mask;
+};
+
+static int launchChild(void* arg) {
+    Launch* launch = static_cast<Launch*>(arg);
+    // Handlers go back to the default before signals are let through.
+    for (int sig = 1; sig < NSIG; ++sig) {
+        struct sigaction sa{};
+        if (sigaction(sig, nullptr, &sa) == 0 && sa.sa_handler != SIG_DFL && sa.sa_handler != SIG_IGN) {
+            sa.sa_handler = SIG_DFL;
+            sa.sa_flags = 0;
+            sigaction(sig, &sa, nullptr);
+        }
+    }
+    // Ignored by the server, but a program writing to a closed pipe should
+    // die of it as usual.
+    signal(SIGPIPE, SIG_DFL);
+    sigprocmask(SIG_SETMASK, &launch->mask, nullptr);
+
+    setpgid(0, 0);
+    if (launch->outputFd >= 0) {
+        dup2(launch->outputFd, STDOUT_FILENO);
+        dup2(launch->outputFd, STDERR_FILENO);
+    }
+    ptrace(PTRACE_TRACEME, 0, nullptr, nullptr);
+    if (launch->programFd >= 0) fexecve(launch->programFd, launch->argv, environ);
+    else if (launch->argv[0]) execvp(launch->argv[0], launch->argv);
+    _exit(1);
+}
 
 void Tracer::run() {
-    pid_t pid = fork();
-    if (pid == 0) {
-        ptrace(PTRACE_TRACEME, 0, nullptr, nullptr);
-        execl("/bin/sh", "sh", "-c", m_command.c_str(), nullptr);
-        _exit(1);
-    } else if (pid > 0) {
-        int status;
-        waitpid(pid, &status, 0);
-
-        ptrace(PTRACE_SETOPTIONS, pid, 0, 
-               PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK | PTRACE_O_TRACECLONE | 
-               PTRACE_O_TRACEEXEC | PTRACE_O_TRACESYSGOOD);
-
-        ptrace(PTRACE_SYSCALL, pid, 0, 0);
-
-        while (true) {
-            pid_t wpid = waitpid(-1, &status, 0);
-            if (wpid == -1) break;
-
-            if (WIFEXITED(status)) {
-                m_handler({"EXIT", wpid, "Exited with status " + std::to_string(WEXITSTATUS(status))});
-                if (wpid == pid) break;
-            } else if (WIFSIGNALED(status)) {
-                m_handler({"SIGNAL", wpid, "Killed by signal " + std::to_string(WTERMSIG(status))});
-                if (wpid == pid) break;
-            } else if (WIFSTOPPED(status)) {
-                int sig = 0;
-                int stop_sig = WSTOPSIG(status);
-                unsigned int event = status >> 16;
+    int out[2] = {-1, -1};
+    // Close-on-exec, so processes forked concurrently by other requests do
+    // not keep the write end open and delay EOF.
+    if (m_output && pipe2(out, O_CLOEXEC) < 0) {
+        std::cerr << "Tracer: pipe failed: " << strerror(errno) << std::endl;
+        return;
+    }
+
+    // Everything the child needs is prepared here: it shares the server's
+    // memory until it execs and must not allocate.
+    std::vector<char*> args;
+    for (const std::string& a : m_args) args.push_back(const_cast<char*>(a.c_str()));
+    args.push_back(nullptr);
+    char name[] = "trace";
+    char* programArgs[] = {name, nullptr};
+    Launch launch{m_program_fd, out[1], m_program_fd >= 0 ? programArgs : args.data(), {}};
+
+    // No signal handler of the server may run on the child's stack.
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &launch.mask);
+    std::unique_ptr<char[]> stack(new char[kLaunchStackSize]);
+    pid_t pid = clone(launchChild, stack.get() + kLaunchStackSize, CLONE_VM | CLONE_VFORK | SIGCHLD, &launch);
+    pthread_sigmask(SIG_SETMASK, &launch.mask, nullptr);
+
+    if (pid > 0) {
+        // The tracee and everything it forks live in their own process
+        // group, so several tracers (and pclose) can wait concurrently
+        // without reaping each other's children.
+        setpgid(pid, pid);
+        m_pid.store(pid);
+        if (m_cancelled.load()) cancel();
+        if (out[1] >= 0) ::close(out[1]);
+        trace(pid, out[0], nullptr);
+        m_pid.store(0);
+    } else {
+        if (out[0] >= 0) {
+            ::close(out[0]);
+            ::close(out[1]);
+        }
+    }
+}
+
+void Tracer::cancel() {
+    m_cancelled.store(true);
+    pid_t pid = m_pid.load();
+    if (pid > 0) {
+        kill(-pid, SIGKILL);
+        kill(pid, SIGKILL);
+    }
+}
+
+bool Tracer::attach(pid_t pid, int outputFd, const std::function<void()>& release) {
+    m_pid.store(pid);
+    if (m_cancelled.load()) cancel();
+    if (ptrace(PTRACE_ATTACH, pid, nullptr, nullptr) < 0) {
+        std::cerr << "Tracer: attach to " << pid << " failed: " << strerror(errno) << std::endl;
+        kill(pid, SIGKILL);
+        if (outputFd >= 0) ::close(outputFd);
+        return false;
+    }
+    bool stopped = trace(pid, outputFd, release);
+    m_pid.store(0);
+    return stopped;
+}
+
+// Records the first limit the run hit and ends it when `pid` is given.
+void Tracer::exceed(Limit limit, pid_t pid) {
+    Limit none = Limit::None;
+    m_limit.compare_exchange_strong(none, limit);
+    if (pid > 0) {
+        kill(-pid, SIGKILL);
+        kill(pid, SIGKILL);
+    }
+}
+
+// Called at the tracee's first stop, before it runs any code of the
+// snippet; what it forks from then on inherits the limits. RLIMIT_NPROC is
+// not used: it counts every process of the user, the server's threads
+// included, so the tracer counts the run's processes itself.
+void Tracer::applyLimits(pid_t pid) {
+    if (m_limits.cpuSeconds) {
+        // SIGXCPU at the soft limit, SIGKILL a second later if it is caught.
+        rlimit rl{m_limits.cpuSeconds, m_limits.cpuSeconds + 1};
+        prlimit(pid, RLIMIT_CPU, &rl, nullptr);
+    }
+    if (m_limits.memoryBytes) {
+        rlimit rl{m_limits.memoryBytes, m_limits.memoryBytes};
+        prlimit(pid, RLIMIT_AS, &rl, nullptr);
+    }
+    if (m_limits.cgroup.empty()) return;
+
+    m_cgroup.reset(new Cgroup(m_limits.cgroup, "run-" + std::to_string(pid)));
+    if (!m_cgroup->add(pid)) {
+        m_cgroup.reset();
+        return;
+    }
+    // One core at most, so a multithreaded snippet cannot crowd out the
+    // other runs.
+    m_cgroup->set("cpu.max", "100000 100000");
+    if (m_limits.memoryBytes) {
+        m_cgroup->set("memory.max", std::to_string(m_limits.memoryBytes));
+        m_cgroup->set("memory.swap.max", "0");
+    }
+    if (m_limits.processes) m_cgroup->set("pids.max", std::to_string(m_limits.processes + 1));
+}
+
+bool Tracer::trace(pid_t pid, int outputFd, const std::function<void()>& release) {
+    std::thread reader;
+    if (outputFd >= 0 && m_output) {
+        reader = std::thread([this, outputFd]() {
+            char buf[65536];
+            for (;;) {
+                ssize_t n = read(outputFd, buf, sizeof(buf));
+                if (n > 0) m_output(buf, static_cast<size_t>(n), m_seq->fetch_add(1));
+                else if (n < 0 && errno == EINTR) continue;
+                else break;
+            }
+        });
+    }
+
+    m_tracing_done.store(false);
+    m_forked.clear();
+    std::thread sender([this]() { senderLoop(); });
+
+    // The tracing thread blocks in waitpid, so the deadline has a thread
+    // of its own.
+    std::thread watchdog;
+    m_traced = false;
+    if (m_limits.wallMs) {
+        watchdog = std::thread([this, pid]() {
+            std::unique_lock<std::mutex> lock(m_deadline_mutex);
+            if (!m_deadline_cv.wait_for(lock, std::chrono::milliseconds(m_limits.wallMs),
+                                        [this]() { return m_traced; }))
+                exceed(Limit::Wall, pid);
+        });
+    }
+
+    bool detached = traceLoop(pid, release);
+
+    if (watchdog.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(m_deadline_mutex);
+            m_traced = true;
+        }
+        m_deadline_cv.notify_one();
+        watchdog.join();
+    }
+
+    int status;
+    if (detached) {
+        // Only the process itself carries on; what it forked would keep
+        // the pipe open.
+        for (pid_t child : m_forked) kill(child, SIGKILL);
+        for (pid_t child : m_forked) waitpid(child, &status, __WALL);
+    } else {
+        // Descendants still alive after the main process exited would keep
+        // the pipe open (and stay stopped under ptrace), so end them here.
+        kill(-pid, SIGKILL);
+        while (waitpid(-pid, &status, __WALL) > 0) { }
+    }
+
+    if (m_cgroup) {
+        if (m_cgroup->counter("memory.events", "oom_kill") > 0) exceed(Limit::Memory, 0);
+        if (detached) m_cgroup->keep(pid);
+        m_cgroup.reset();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_wake_mutex);
+        m_tracing_done.store(true, std::memory_order_release);
+    }
+    m_wake_cv.notify_one();
+    sender.join();
+
+    if (reader.joinable()) reader.join();
+    if (outputFd >= 0) ::close(outputFd);
+    return detached;
+}
+
+bool Tracer::traceLoop(pid_t pid, const std::function<void()>& release) {
+    int status;
+    waitpid(pid, &status, __WALL);
+    applyLimits(pid);
+
+    ptrace(PTRACE_SETOPTIONS, pid, 0, 
+           PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK | PTRACE_O_TRACECLONE | 
+           PTRACE_O_TRACEEXEC | PTRACE_O_TRACESYSGOOD);
+
+    ptrace(PTRACE_SYSCALL, pid, 0, 0);
+    if (release) release();
+
+    while (true) {
+        pid_t wpid = waitpid(-pid, &status, __WALL);
+        if (wpid == -1) break;
+
+        if (WIFEXITED(status)) {
+            emit(Record::Exited, wpid, WEXITSTATUS(status));
+            m_forked.erase(wpid);
+            // A failed allocation usually ends in bad_alloc or a crash.
+            if (wpid == pid && m_memory_denied && WEXITSTATUS(status) != 0) exceed(Limit::Memory, 0);
+            if (wpid == pid) break;
+        } else if (WIFSIGNALED(status)) {
+            emit(Record::Killed, wpid, WTERMSIG(status));
+            m_forked.erase(wpid);
+            if (wpid == pid && m_memory_denied) exceed(Limit::Memory, 0);
+            if (wpid == pid) break;
+        } else if (release && wpid == pid && WIFSTOPPED(status) && WSTOPSIG(status) == SIGSTOP &&
+                   (status >> 16) == 0) {
+            // An attached process marks the end of its work this way.
+            ptrace(PTRACE_DETACH, pid, 0, 0);
+            return true;
+        } else if (WIFSTOPPED(status)) {
+            int sig = 0;
+            int stop_sig = WSTOPSIG(status);
+            unsigned int event = status >> 16;
+            
+            if (event != 0) {
+                if (event == PTRACE_EVENT_FORK || 
+                    event == PTRACE_EVENT_VFORK || 
+                    event == PTRACE_EVENT_CLONE) {
+                    handleFork(wpid, event != PTRACE_EVENT_CLONE);
+                } else if (event == PTRACE_EVENT_EXEC) {
+                    emit(Record::Exec, wpid, 0);
+                }
+            } else if (stop_sig == (SIGTRAP | 0x80)) {
+                handleSyscall(wpid);
+            } else {
+                sig = stop_sig;
                 
-                if (event != 0) {
-                    if (event == PTRACE_EVENT_FORK || 
-                        event == PTRACE_EVENT_VFORK || 
-                        event == PTRACE_EVENT_CLONE) {
-                        handleFork(wpid);
-                    } else if (event == PTRACE_EVENT_EXEC) {
-                        m_handler({"EXEC", wpid, "Execve called"});
-                    }
-                } else if (stop_sig == (SIGTRAP | 0x80)) {
-                    handleSyscall(wpid);
-                } else {
-                    sig = stop_sig;
-                    
-                    if (sig == SIGSTOP || sig == SIGTRAP || sig == 19) {
-                        sig = 0;
-                    }
-                    
-                    if (sig != 0) {
-                        m_handler({"SIGNAL", wpid, "Received signal " + std::to_string(sig)});
-                    }
+                if (sig == SIGSTOP || sig == SIGTRAP || sig == 19) {
+                    sig = 0;
                 }
                 
-                ptrace(PTRACE_SYSCALL, wpid, 0, sig);
+                if (sig != 0) {
+                    emit(Record::Signal, wpid, sig);
+                }
+                if (sig == SIGXCPU) exceed(Limit::Cpu, 0);
             }
+            
+            ptrace(PTRACE_SYSCALL, wpid, 0, sig);
+        }
+    }
+    return false;
+}
+
+// Called with the tracee stopped, so it only records; formatting and the
+// handler run on the sender thread. The sender is woken only when it went
+// idle, which keeps the two threads from ping-ponging on every stop. The
+// sequence number is taken before the tracee resumes, so output its
+// syscall writes is numbered after it.
+void Tracer::emit(Record::Kind kind, pid_t pid, long value) {
+    Record r{kind, pid, value, m_seq->fetch_add(1)};
+    if (!m_records.tryPush(r)) {
+        // The sender is behind (a slow client under Overflow::Block): the
+        // tracee stays stopped until there is room.
+        std::unique_lock<std::mutex> lock(m_wake_mutex);
+        for (;;) {
+            m_producer_blocked.store(true);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (m_records.tryPush(r)) break;
+            m_space_cv.wait(lock, [this]() { return !m_producer_blocked.load(); });
         }
+        m_producer_blocked.store(false);
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_sender_idle.load()) {
+        std::lock_guard<std::mutex> lock(m_wake_mutex);
+        m_sender_idle.store(false);
+        m_wake_cv.notify_one();
     }
 }
 
+void Tracer::senderLoop() {
+    Record r;
+    for (;;) {
+        if (m_records.tryPop(r)) {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (m_producer_blocked.load()) {
+                std::lock_guard<std::mutex> lock(m_wake_mutex);
+                m_producer_blocked.store(false);
+                m_space_cv.notify_one();
+            }
+            m_handler(toEvent(r));
+            continue;
+        }
+        if (m_tracing_done.load(std::memory_order_acquire)) {
+            while (m_records.tryPop(r)) m_handler(toEvent(r));
+            return;
+        }
+
+        // The flag is raised before the ring is checked again, so emit()
+        // either sees it or its record is found here.
+        std::unique_lock<std::mutex> lock(m_wake_mutex);
+        m_sender_idle.store(true);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_records.empty() && !m_tracing_done.load())
+            m_wake_cv.wait(lock, [this]() { return !m_sender_idle.load() || m_tracing_done.load(); });
+        m_sender_idle.store(false);
+    }
+}
+
+TraceEvent Tracer::toEvent(const Record& r) {
+    switch (r.kind) {
+    case Record::Syscall: return {"SYSCALL", r.pid, getSyscallName(r.value), r.seq};
+    case Record::Fork:    return {"FORK", r.pid, "Created process " + std::to_string(r.value), r.seq};
+    case Record::Exec:    return {"EXEC", r.pid, "Execve called", r.seq};
+    case Record::Exited:  return {"EXIT", r.pid, "Exited with status " + std::to_string(r.value), r.seq};
+    case Record::Killed:  return {"SIGNAL", r.pid, "Killed by signal " + std::to_string(r.value), r.seq};
+    case Record::Signal:  return {"SIGNAL", r.pid, "Received signal " + std::to_string(r.value), r.seq};
+    }
+    return {"UNKNOWN", r.pid, "", r.seq};
+}
+
 void Tracer::handleSyscall(pid_t pid) {
-    struct user_regs_struct regs;
-    ptrace(PTRACE_GETREGS, pid, 0, &regs);
-    
-    std::string name = getSyscallName(regs.orig_rax);
-    m_handler({"SYSCALL", pid, name});
+    // Only orig_rax is needed, which is cheaper to fetch than all registers.
+    long nr = ptrace(PTRACE_PEEKUSER, pid, offsetof(struct user_regs_struct, orig_rax), 0);
+    if (nr == -1) {
+        // The exit of a call refused below.
+        ptrace(PTRACE_POKEUSER, pid, offsetof(struct user_regs_struct, rax), static_cast<long>(-EPERM));
+        return;
+    }
+    emit(Record::Syscall, pid, nr);
+    // Every process of the run stays in its process group, which the
+    // tracer waits on and kills as a whole: leaving it through setsid or
+    // setpgid is refused at the call's entry (where rax is -ENOSYS) by
+    // turning it into no call at all.
+    if ((nr == SYS_setsid || nr == SYS_setpgid) &&
+        ptrace(PTRACE_PEEKUSER, pid, offsetof(struct user_regs_struct, rax), 0) == -ENOSYS) {
+        ptrace(PTRACE_POKEUSER, pid, offsetof(struct user_regs_struct, orig_rax), -1L);
+        return;
+    }
+    // Under RLIMIT_AS an allocation fails instead of the process being
+    // killed; seen at the syscall's exit, it explains how the run ends.
+    if (m_limits.memoryBytes && (nr == SYS_mmap || nr == SYS_mremap) &&
+        ptrace(PTRACE_PEEKUSER, pid, offsetof(struct user_regs_struct, rax), 0) == -ENOMEM)
+        m_memory_denied = true;
 }
 
-void Tracer::handleFork(pid_t pid) {
+void Tracer::handleFork(pid_t pid, bool process) {
     unsigned long new_pid;
     ptrace(PTRACE_GETEVENTMSG, pid, 0, &new_pid);
-    m_handler({"FORK", pid, "Created process " + std::to_string(new_pid)});
+    if (process) m_forked.insert(static_cast<pid_t>(new_pid));
+    emit(Record::Fork, pid, static_cast<long>(new_pid));
+    if (process && m_limits.processes && m_forked.size() > m_limits.processes) {
+        // A fork bomb: the whole tree goes, including children that left
+        // the process group.
+        for (pid_t child : m_forked) kill(child, SIGKILL);
+        exceed(Limit::Processes, m_pid.load());
+    }
 }
 
 std::string Tracer::getSyscallName(long syscall_nr) {
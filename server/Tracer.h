@@ -4,27 +4,120 @@
 #include <string>
 #include <vector>
 #include <functional>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_set>
+#include <memory>
 #include <sys/types.h>
+#include "SpscRing.h"
+
+class Cgroup;
 
 struct TraceEvent {
     std::string type;
     pid_t pid;
     std::string details;
+    // Place of the stop among the run's events and output chunks.
+    uint64_t seq;
 };
 
 class Tracer {
 public:
     using EventHandler = std::function<void(const TraceEvent&)>;
+    // Receives the tracee's stdout and stderr in chunks as they are written.
+    // `seq` is taken when the chunk is read, so it follows the sequence
+    // number of the write that produced it.
+    using OutputHandler = std::function<void(const char*, size_t, uint64_t seq)>;
+
+    // Bounds on one run; 0 (or an empty cgroup) leaves that one unbounded.
+    struct Limits {
+        unsigned cpuSeconds = 0;
+        size_t memoryBytes = 0;
+        // Processes the run may have alive besides the first.
+        unsigned processes = 0;
+        unsigned wallMs = 0;
+        // Parent of a cgroup v2 per run, prepared with Cgroup::prepare().
+        std::string cgroup;
+    };
+    // The limit that ended a run, if any.
+    enum class Limit { None, Cpu, Wall, Memory, Processes };
+    static const char* limitName(Limit limit);
 
-    Tracer(const std::string& command, EventHandler handler);
+    // Runs args[0], looked up in PATH, with the given arguments.
+    Tracer(const std::vector<std::string>& args, EventHandler handler);
+    // Runs the executable open on `programFd` directly, without a shell.
+    Tracer(int programFd, EventHandler handler);
+    ~Tracer();
+    // When set, the tracee writes to a pipe drained by a reader thread
+    // instead of inheriting the server's stdout/stderr.
+    void setOutputHandler(OutputHandler handler) { m_output = std::move(handler); }
+    // Numbers events and output from `counter` instead of from 0, so they
+    // can be ordered with what the caller numbers from it too.
+    void setSequence(std::atomic<uint64_t>& counter) { m_seq = &counter; }
+    // The event handler runs on a separate sender thread, in stop order.
     void run();
+    // Traces `pid`, a process of its own group that is waiting to be let go
+    // by `release`; its output arrives on `outputFd`, which is taken over.
+    // Returns true when the process stopped itself with SIGSTOP, in which
+    // case it is left running, detached; false when it exited or was killed.
+    bool attach(pid_t pid, int outputFd, const std::function<void()>& release);
+    // Kills the tracee and its process group from any thread; run() or
+    // attach() then return once the tracer has seen it go.
+    void cancel();
+    void setLimits(const Limits& limits) { m_limits = limits; }
+    Limit limitHit() const noexcept { return m_limit.load(); }
 
 private:
-    std::string m_command;
+    // One ptrace stop, recorded by the tracing thread so it can resume the
+    // tracee at once; the sender thread turns it into a TraceEvent.
+    struct Record {
+        enum Kind : uint8_t { Syscall, Fork, Exec, Exited, Killed, Signal };
+        Kind kind;
+        pid_t pid;
+        long value;
+        uint64_t seq;
+    };
+
+    std::vector<std::string> m_args;
+    int m_program_fd;
+    std::atomic<pid_t> m_pid;
+    std::atomic<bool> m_cancelled;
+    Limits m_limits;
+    std::atomic<Limit> m_limit;
+    // An allocation failed with ENOMEM under the memory limit.
+    bool m_memory_denied;
+    std::unique_ptr<Cgroup> m_cgroup;
     EventHandler m_handler;
+    OutputHandler m_output;
+    std::atomic<uint64_t> m_own_seq;
+    std::atomic<uint64_t>* m_seq;
+
+    SpscRing<Record> m_records;
+    std::atomic<bool> m_tracing_done;
+    std::mutex m_wake_mutex;
+    // The sender waits here once the ring is empty, the tracing thread
+    // once it is full; each flag says the other side has to wake it.
+    std::condition_variable m_wake_cv;
+    std::condition_variable m_space_cv;
+    std::atomic<bool> m_sender_idle;
+    std::atomic<bool> m_producer_blocked;
+    // Wakes the wall-clock watchdog when the tracee is gone.
+    std::mutex m_deadline_mutex;
+    std::condition_variable m_deadline_cv;
+    bool m_traced;
+    // Processes forked by the tracee that have not exited yet.
+    std::unordered_set<pid_t> m_forked;
 
+    bool trace(pid_t pid, int outputFd, const std::function<void()>& release);
+    bool traceLoop(pid_t pid, const std::function<void()>& release);
+    void applyLimits(pid_t pid);
+    void exceed(Limit limit, pid_t pid);
+    void emit(Record::Kind kind, pid_t pid, long value);
+    void senderLoop();
+    TraceEvent toEvent(const Record& r);
     void handleSyscall(pid_t pid);
-    void handleFork(pid_t pid);
+    void handleFork(pid_t pid, bool process);
     std::string getSyscallName(long syscall_nr);
 };
 
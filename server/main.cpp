@@ -1,16 +1,108 @@
 #include "Server.h"
 #include "Database.h"
 #include <iostream>
+#include <cstring>
+
+static void usage(const char* prog) {
+    std::cerr << "Usage: " << prog << " <port> [--io=threads|epoll|uring] [--workers=N] [--queue=N]\n"
+              << "       [--procs=N] [--pin-cpu]\n"
+              << "       [--out-queue=BYTES] [--overflow=block|drop|summarize]\n"
+              << "       [--cache-mb=N] [--cache-dir=PATH] [--snapshots] [--zygote] [--tiered]\n"
+              << "       [--compile-jobs=N] [--compile-mem-mb=N]\n"
+              << "       [--run-cpu-s=N] [--run-wall-ms=N] [--run-mem-mb=N] [--run-procs=N] [--cgroup=DIR]\n";
+}
 
 int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        std::cerr << "Usage: " << argv[0] << " <port>\n";
+    if (argc < 2) {
+        usage(argv[0]);
         return 1;
     }
 
+    Server::IoMode mode = Server::IoMode::Threads;
+    size_t workers = 0;
+    size_t queue = 0;
+    unsigned procs = 0;
+    bool pinCpu = false;
+    size_t outQueue = 1024 * 1024;
+    OutputBatcher::Overflow overflow = OutputBatcher::Overflow::Block;
+    size_t cacheMb = 64;
+    std::string cacheDir = "trace_cache";
+    bool snapshots = false;
+    bool zygote = false;
+    bool tiered = false;
+    size_t compileJobs = 0;
+    size_t compileMemMb = 0;
+    // 0 turns a run limit off.
+    Tracer::Limits runLimits;
+    runLimits.cpuSeconds = 10;
+    runLimits.wallMs = 20000;
+    runLimits.memoryBytes = 1024 * 1024 * 1024;
+    runLimits.processes = 64;
+    for (int i = 2; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--io=threads") == 0) {
+            mode = Server::IoMode::Threads;
+        } else if (std::strcmp(argv[i], "--io=epoll") == 0) {
+            mode = Server::IoMode::Epoll;
+        } else if (std::strcmp(argv[i], "--io=uring") == 0) {
+            mode = Server::IoMode::IoUring;
+        } else if (std::strncmp(argv[i], "--workers=", 10) == 0) {
+            workers = std::stoul(argv[i] + 10);
+        } else if (std::strncmp(argv[i], "--queue=", 8) == 0) {
+            queue = std::stoul(argv[i] + 8);
+        } else if (std::strncmp(argv[i], "--procs=", 8) == 0) {
+            procs = static_cast<unsigned>(std::stoul(argv[i] + 8));
+        } else if (std::strcmp(argv[i], "--pin-cpu") == 0) {
+            pinCpu = true;
+        } else if (std::strncmp(argv[i], "--out-queue=", 12) == 0) {
+            outQueue = std::stoul(argv[i] + 12);
+        } else if (std::strcmp(argv[i], "--overflow=block") == 0) {
+            overflow = OutputBatcher::Overflow::Block;
+        } else if (std::strcmp(argv[i], "--overflow=drop") == 0) {
+            overflow = OutputBatcher::Overflow::Drop;
+        } else if (std::strcmp(argv[i], "--overflow=summarize") == 0) {
+            overflow = OutputBatcher::Overflow::Summarize;
+        } else if (std::strncmp(argv[i], "--cache-mb=", 11) == 0) {
+            cacheMb = std::stoul(argv[i] + 11);
+        } else if (std::strncmp(argv[i], "--cache-dir=", 12) == 0) {
+            cacheDir = argv[i] + 12;
+        } else if (std::strcmp(argv[i], "--snapshots") == 0) {
+            snapshots = true;
+        } else if (std::strcmp(argv[i], "--zygote") == 0) {
+            zygote = true;
+        } else if (std::strcmp(argv[i], "--tiered") == 0) {
+            tiered = true;
+        } else if (std::strncmp(argv[i], "--compile-jobs=", 15) == 0) {
+            compileJobs = std::stoul(argv[i] + 15);
+        } else if (std::strncmp(argv[i], "--compile-mem-mb=", 17) == 0) {
+            compileMemMb = std::stoul(argv[i] + 17);
+        } else if (std::strncmp(argv[i], "--run-cpu-s=", 12) == 0) {
+            runLimits.cpuSeconds = static_cast<unsigned>(std::stoul(argv[i] + 12));
+        } else if (std::strncmp(argv[i], "--run-wall-ms=", 14) == 0) {
+            runLimits.wallMs = static_cast<unsigned>(std::stoul(argv[i] + 14));
+        } else if (std::strncmp(argv[i], "--run-mem-mb=", 13) == 0) {
+            runLimits.memoryBytes = std::stoul(argv[i] + 13) * 1024 * 1024;
+        } else if (std::strncmp(argv[i], "--run-procs=", 12) == 0) {
+            runLimits.processes = static_cast<unsigned>(std::stoul(argv[i] + 12));
+        } else if (std::strncmp(argv[i], "--cgroup=", 9) == 0) {
+            runLimits.cgroup = argv[i] + 9;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
     uint16_t port = static_cast<uint16_t>(std::stoi(argv[1]));
     Database db("database.xml");
-    Server server(port, &db);
+    Server server(port, &db, mode);
+    server.setWorkerLimits(workers, queue);
+    server.setWorkerProcesses(procs, pinCpu);
+    server.setOutputLimits(outQueue, overflow);
+    server.setCompileCache(cacheMb * 1024 * 1024, cacheDir);
+    server.setSnapshots(snapshots);
+    server.setZygote(zygote);
+    server.setTiered(tiered);
+    server.setCompileLimits(compileJobs, compileMemMb * 1024 * 1024);
+    server.setRunLimits(runLimits);
 
     try {
         std::cout << "Starting server on port " << port << "...\n";
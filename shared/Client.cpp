@@ -19,14 +19,17 @@ static void timeout_handler(int sig)
 }
 
 Client::Client(const std::string &host, uint16_t port) noexcept
-    : m_host(host), m_port(port), m_sockfd(-1)
+    : m_host(host), m_port(port), m_sockfd(-1), m_next_id(0)
 {
 }
 
 Client::Client(Client &&other) noexcept
     : m_host(std::move(other.m_host)),
       m_port(other.m_port),
-      m_sockfd(other.m_sockfd)
+      m_sockfd(other.m_sockfd),
+      m_next_id(other.m_next_id),
+      m_reader(std::move(other.m_reader)),
+      m_traces(std::move(other.m_traces))
 {
     other.m_sockfd = -1;
 }
@@ -39,6 +42,9 @@ Client &Client::operator=(Client &&other) noexcept
         m_host = std::move(other.m_host);
         m_port = other.m_port;
         m_sockfd = other.m_sockfd;
+        m_next_id = other.m_next_id;
+        m_reader = std::move(other.m_reader);
+        m_traces = std::move(other.m_traces);
         other.m_sockfd = -1;
     }
     return *this;
@@ -126,6 +132,62 @@ size_t Client::sendAll(const void *data, size_t len)
     return total;
 }
 
+uint32_t Client::sendFrame(MsgType type, const std::string &payload, uint8_t flags)
+{
+    uint32_t id = ++m_next_id;
+    sendString(encodeFrame(type, id, payload, flags));
+    return id;
+}
+
+Frame Client::readFrame()
+{
+    Frame frame;
+    char buf[4096];
+    while (!m_reader.next(frame))
+    {
+        ssize_t n = recvSome(buf, sizeof(buf));
+        if (n == 0)
+            throw std::runtime_error("Server disconnected");
+        m_reader.feed(buf, static_cast<size_t>(n));
+    }
+    if (frame.type == MsgType::Error)
+        throw std::runtime_error("Server error: " + frame.payload);
+    return frame;
+}
+
+// Reads frames until the one answering requestId arrives, handing frames
+// of pipelined traces to their callbacks on the way.
+Frame Client::awaitReply(uint32_t requestId)
+{
+    for (;;)
+    {
+        Frame frame = readFrame();
+        if (frame.requestId == requestId)
+            return frame;
+        dispatchTraceFrame(frame);
+    }
+}
+
+void Client::dispatchTraceFrame(const Frame &frame)
+{
+    auto it = m_traces.find(frame.requestId);
+    if (it == m_traces.end())
+        return;
+
+    PendingTrace &t = it->second;
+    if (frame.type == MsgType::TraceEvent) {
+        if (t.onTrace) t.onTrace(frame.payload);
+    } else if (frame.type == MsgType::Output) {
+        if (t.onOut) t.onOut(frame.payload);
+    } else if (frame.type == MsgType::Busy) {
+        t.busyReason = frame.payload;
+    } else if (frame.type == MsgType::TraceEnd) {
+        PendingTrace done = std::move(t);
+        m_traces.erase(it);
+        if (done.onDone) done.onDone(done.busyReason);
+    }
+}
+
 std::string Client::callWithTimeout(const std::string &msg, unsigned int seconds)
 {
     if (!isConnected())
@@ -139,74 +201,102 @@ std::string Client::callWithTimeout(const std::string &msg, unsigned int seconds
 
     alarm(seconds);
 
-    sendString(msg);
-
-    char buf[1024]{};
-    ssize_t n = recvSome(buf, sizeof(buf));
+    uint32_t id = sendFrame(MsgType::Call, msg);
+    Frame reply = awaitReply(id);
 
     alarm(0);
 
-    return std::string(buf, n);
+    return reply.payload;
+}
+
+std::string Client::stats()
+{
+    ensureConnected();
+    uint32_t id = sendFrame(MsgType::Stats, "");
+    return awaitReply(id).payload;
 }
 
 void Client::trace(const std::string& command, 
                    std::function<void(const std::string&)> traceCallback,
                    std::function<void(const std::string&)> outCallback) {
+    std::string busyReason;
+    uint32_t id = traceAsync(command, traceCallback, outCallback,
+                             [&busyReason](const std::string &reason) { busyReason = reason; });
+    wait(id);
+
+    if (!busyReason.empty())
+        throw ServerBusyError(busyReason);
+}
+
+uint32_t Client::traceAsync(const std::string &command,
+                            LineCallback traceCallback,
+                            LineCallback outCallback,
+                            DoneCallback doneCallback,
+                            bool isolated,
+                            bool stopOnError,
+                            bool sequenced)
+{
+    ensureConnected();
+
+    uint8_t flags = (isolated ? kFlagIsolated : 0) | (stopOnError ? kFlagStopOnError : 0) |
+                    (sequenced ? kFlagSequenced : 0);
+    uint32_t id = sendFrame(MsgType::Trace, command, flags);
+    m_traces[id] = PendingTrace{std::move(traceCallback), std::move(outCallback), std::move(doneCallback), ""};
+    return id;
+}
+
+void Client::cancel(uint32_t requestId)
+{
+    ensureConnected();
+    sendString(encodeFrame(MsgType::Cancel, requestId, ""));
+}
+
+void Client::wait(uint32_t requestId)
+{
+    while (m_traces.count(requestId))
+        dispatchTraceFrame(readFrame());
+}
+
+void Client::waitAll()
+{
+    while (!m_traces.empty())
+        dispatchTraceFrame(readFrame());
+}
+
+void Client::poll()
+{
     ensureConnected();
-    
-    std::string msg = "TRACE " + command;
-    ssize_t sent = send(m_sockfd, msg.c_str(), msg.size(), 0);
-    if (sent < 0) {
-        throw std::system_error(errno, std::generic_category(), "send() failed");
-    }
-    
     char buf[4096];
-    for (;;) {
-        ssize_t r = recv(m_sockfd, buf, sizeof(buf) - 1, 0);
-        if (r > 0) {
-            buf[r] = '\0';
-            std::string chunk(buf);
-            
-            size_t endPos = chunk.find("TRACE_END\n");
-            if (endPos != std::string::npos) {
-                chunk = chunk.substr(0, endPos);
-                
-                if (!chunk.empty()) {
-                    
-                    size_t start = 0;
-                    size_t pos = 0;
-                    while ((pos = chunk.find('\n', start)) != std::string::npos) {
-                        std::string line = chunk.substr(start, pos - start);
-                        if (line.rfind("TRACE:", 0) == 0) {
-                            traceCallback(line.substr(6));
-                        } else if (line.rfind("OUT:", 0) == 0) {
-                            outCallback(line.substr(4));
-                        }
-                        start = pos + 1;
-                    }
-                }
-                break;
-            }
-            
-            
-            size_t start = 0;
-            size_t pos = 0;
-            while ((pos = chunk.find('\n', start)) != std::string::npos) {
-                std::string line = chunk.substr(start, pos - start);
-                if (line.rfind("TRACE:", 0) == 0) {
-                    traceCallback(line.substr(6));
-                } else if (line.rfind("OUT:", 0) == 0) {
-                    outCallback(line.substr(4));
-                }
-                start = pos + 1;
-            }
-        } else if (r == 0) {
-            throw std::runtime_error("Server disconnected during trace");
-        } else {
-            if (errno == EINTR) continue;
-            throw std::system_error(errno, std::generic_category(), "recv() failed");
+    bool closed = false;
+    for (;;)
+    {
+        ssize_t n = recv(m_sockfd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (n > 0)
+        {
+            m_reader.feed(buf, static_cast<size_t>(n));
+            continue;
+        }
+        if (n == 0)
+        {
+            closed = true;
+            break;
         }
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            break;
+        throw std::system_error(errno, std::generic_category(), "recv failed");
+    }
+
+    Frame frame;
+    while (m_reader.next(frame))
+    {
+        if (frame.type == MsgType::Error)
+            throw std::runtime_error("Server error: " + frame.payload);
+        dispatchTraceFrame(frame);
     }
+    if (closed)
+        throw std::runtime_error("Server disconnected");
 }
 
 ssize_t Client::recvSome(void *buffer, size_t max_len)
@@ -229,5 +319,7 @@ void Client::close()
         ::shutdown(m_sockfd, SHUT_RDWR);
         ::close(m_sockfd);
         m_sockfd = -1;
+        m_reader = FrameReader();
+        m_traces.clear();
     }
 }
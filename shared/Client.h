@@ -4,16 +4,30 @@
 #include <string>
 #include <stdexcept>
 #include <functional>
+#include <unordered_map>
 #include <netinet/in.h>
 #include "tinyxml2.h"
 using namespace tinyxml2;
 #include "Database.h"
+#include "Protocol.h"
 
 struct sockaddr_in;
 
+// Thrown by Client::trace when the server's job queue is full.
+class ServerBusyError : public std::runtime_error
+{
+public:
+    using std::runtime_error::runtime_error;
+};
+
 class Client
 {
 public:
+    using LineCallback = std::function<void(const std::string &)>;
+    // Called when a pipelined trace finishes; busyReason is empty unless the
+    // server rejected the request because its queue was full.
+    using DoneCallback = std::function<void(const std::string &busyReason)>;
+
     explicit Client(const std::string &host = "127.0.0.1", uint16_t port = 12345) noexcept;
 
     Client(const Client &) = delete;
@@ -27,21 +41,64 @@ public:
     void trace(const std::string& command, 
                std::function<void(const std::string&)> traceCallback,
                std::function<void(const std::string&)> outCallback);
+    // Pipelining: sends the request and returns its id without waiting.
+    // Callbacks run from wait()/waitAll() (or any other blocking call) as
+    // frames arrive, in whatever order the server completes requests.
+    // Isolated requests ignore the session's code history and do not wait
+    // for earlier requests on the server. Compiler diagnostics arrive on
+    // outCallback as they are produced; stopOnError ends the compile at the
+    // first error. With sequenced, both callbacks get lines prefixed with
+    // their sequence number (see splitSequenced()), for merging the two
+    // streams in causal order.
+    uint32_t traceAsync(const std::string &command,
+                        LineCallback traceCallback,
+                        LineCallback outCallback,
+                        DoneCallback doneCallback = nullptr,
+                        bool isolated = false,
+                        bool stopOnError = false,
+                        bool sequenced = false);
+    // Asks the server to stop a trace; its doneCallback still runs, once the
+    // server has killed the compile or the program.
+    void cancel(uint32_t requestId);
+    void wait(uint32_t requestId);
+    void waitAll();
+    // Dispatches the frames that have already arrived without blocking, for
+    // callers that watch fd() in their own event loop. Throws like wait()
+    // when the server goes away.
+    void poll();
+    size_t pendingTraces() const noexcept { return m_traces.size(); }
+    std::string stats();
     size_t sendString(const std::string &s) { return sendAll(s.data(), s.size()); }
     ssize_t recvSome(void *buffer, size_t max_len);
     void close();
     bool isConnected() const noexcept { return m_sockfd >= 0; }
+    int fd() const noexcept { return m_sockfd; }
     std::string host() const noexcept { return m_host; }
     uint16_t port() const noexcept { return m_port; }
 
 private:
     void ensureNotConnected() const;
     void ensureConnected() const;
+    uint32_t sendFrame(MsgType type, const std::string &payload, uint8_t flags = 0);
+    Frame readFrame();
+    Frame awaitReply(uint32_t requestId);
+    void dispatchTraceFrame(const Frame &frame);
+
+    struct PendingTrace
+    {
+        LineCallback onTrace;
+        LineCallback onOut;
+        DoneCallback onDone;
+        std::string busyReason;
+    };
 
 private:
     std::string m_host;
     uint16_t m_port;
     int m_sockfd;
+    uint32_t m_next_id;
+    FrameReader m_reader;
+    std::unordered_map<uint32_t, PendingTrace> m_traces;
 };
 
 #endif
@@ -27,6 +27,22 @@ void Database::load() {
     }
 }
 
+void Database::reopen(const std::string& newFilename) {
+    std::lock_guard<std::recursive_mutex> lock(m_mutex);
+    filename = newFilename;
+    doc.Clear();
+    load();
+}
+
+// database.xml -> database.worker3.xml
+std::string Database::workerFilename(unsigned index) const {
+    std::string suffix = ".worker" + std::to_string(index);
+    size_t dot = filename.rfind('.');
+    if (dot == std::string::npos || filename.find('/', dot) != std::string::npos)
+        return filename + suffix;
+    return filename.substr(0, dot) + suffix + filename.substr(dot);
+}
+
 void Database::save() {
     std::lock_guard<std::recursive_mutex> lock(m_mutex);
     doc.SaveFile(filename.c_str());
@@ -8,6 +8,8 @@ class Database {
 public:
     Database(const std::string& filename = "database.xml");
     void load();
+    void reopen(const std::string& newFilename);
+    std::string workerFilename(unsigned index) const;
     void save();
     void addLog(const std::string& message);
     void setStateVariable(const std::string& name, const std::string& value);
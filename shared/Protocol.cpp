@@ -0,0 +1,85 @@
+#include "Protocol.h"
+
+static void putU32(std::string& out, uint32_t v) {
+    out.push_back(static_cast<char>((v >> 24) & 0xff));
+    out.push_back(static_cast<char>((v >> 16) & 0xff));
+    out.push_back(static_cast<char>((v >> 8) & 0xff));
+    out.push_back(static_cast<char>(v & 0xff));
+}
+
+static uint32_t getU32(const char* p) {
+    const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+    return (static_cast<uint32_t>(u[0]) << 24) | (static_cast<uint32_t>(u[1]) << 16) |
+           (static_cast<uint32_t>(u[2]) << 8) | static_cast<uint32_t>(u[3]);
+}
+
+void appendFrame(std::string& out, MsgType type, uint32_t requestId, const std::string& payload, uint8_t flags) {
+    out.reserve(out.size() + kFrameHeaderSize + payload.size());
+    out.push_back(static_cast<char>(kFrameMagic));
+    out.push_back(static_cast<char>(kProtocolVersion));
+    out.push_back(static_cast<char>(type));
+    out.push_back(static_cast<char>(flags));
+    putU32(out, requestId);
+    putU32(out, static_cast<uint32_t>(payload.size()));
+    out += payload;
+}
+
+std::string encodeFrame(MsgType type, uint32_t requestId, const std::string& payload, uint8_t flags) {
+    std::string out;
+    appendFrame(out, type, requestId, payload, flags);
+    return out;
+}
+
+bool splitSequenced(const std::string& payload, uint64_t& seq, std::string& text) {
+    size_t space = payload.find(' ');
+    if (space == 0 || space == std::string::npos) return false;
+    uint64_t value = 0;
+    for (size_t i = 0; i < space; ++i) {
+        if (payload[i] < '0' || payload[i] > '9') return false;
+        value = value * 10 + static_cast<uint64_t>(payload[i] - '0');
+    }
+    seq = value;
+    text = payload.substr(space + 1);
+    return true;
+}
+
+FrameReader::FrameReader(uint32_t maxPayload)
+    : m_pos(0), m_max_payload(maxPayload)
+{
+}
+
+void FrameReader::feed(const char* data, size_t len) {
+    // Drop consumed bytes before they dominate the buffer.
+    if (m_pos > 0 && m_pos >= m_buf.size() / 2) {
+        m_buf.erase(0, m_pos);
+        m_pos = 0;
+    }
+    m_buf.append(data, len);
+}
+
+bool FrameReader::next(Frame& out) {
+    if (buffered() < kFrameHeaderSize) return false;
+
+    const char* h = m_buf.data() + m_pos;
+    if (static_cast<uint8_t>(h[0]) != kFrameMagic)
+        throw ProtocolError("bad frame magic");
+    if (static_cast<uint8_t>(h[1]) != kProtocolVersion)
+        throw ProtocolError("unsupported protocol version " + std::to_string(static_cast<uint8_t>(h[1])));
+
+    uint32_t len = getU32(h + 8);
+    if (len > m_max_payload)
+        throw ProtocolError("frame payload too large: " + std::to_string(len) + " bytes");
+    if (buffered() < kFrameHeaderSize + len) return false;
+
+    out.type = static_cast<MsgType>(static_cast<uint8_t>(h[2]));
+    out.flags = static_cast<uint8_t>(h[3]);
+    out.requestId = getU32(h + 4);
+    out.payload.assign(h + kFrameHeaderSize, len);
+    m_pos += kFrameHeaderSize + len;
+
+    if (m_pos == m_buf.size()) {
+        m_buf.clear();
+        m_pos = 0;
+    }
+    return true;
+}
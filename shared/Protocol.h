@@ -0,0 +1,86 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <stdexcept>
+
+// Every message between Client and Server is one frame: a fixed 12-byte
+// header followed by `length` payload bytes. All integers are big endian.
+//
+//   0      1        2     3      4            8
+//   +------+--------+-----+------+------------+------------+
+//   | 'R'  | version| type| flags| request id |   length   |
+//   +------+--------+-----+------+------------+------------+
+constexpr uint8_t kFrameMagic = 'R';
+constexpr uint8_t kProtocolVersion = 1;
+constexpr size_t kFrameHeaderSize = 12;
+constexpr uint32_t kMaxFramePayload = 16 * 1024 * 1024;
+
+enum class MsgType : uint8_t {
+    Call = 1,        // generic request, echoed back as Reply
+    Reply = 2,
+    Trace = 3,       // payload: C++ statements to compile and trace
+    TraceEvent = 4,  // payload: "SYSCALL [pid]: name"
+    Output = 5,      // payload: one line of program or compiler output
+    TraceEnd = 6,    // last frame of a Trace request; limit= names the run
+                     // limit that ended the program, if any
+    Busy = 7,        // request rejected, retry later; followed by TraceEnd
+    Error = 8,
+    Stats = 9,       // request with empty payload, answered with Stats
+    Cancel = 10      // stops the Trace with this request id; no reply of its
+                     // own, the Trace ends with a TraceEnd marked cancelled=1
+};
+
+// Trace: run without the connection's code history and leave it untouched,
+// so the request does not wait for earlier ones and may finish first.
+constexpr uint8_t kFlagIsolated = 0x01;
+// Trace: stop compiling at the first error instead of reporting them all.
+// Compiler diagnostics are sent as Output lines while g++ runs either way.
+constexpr uint8_t kFlagStopOnError = 0x02;
+// Trace: number the TraceEvent and Output frames of the request in one
+// causal order. Those frames then carry the flag too, and their payload
+// starts with the decimal sequence number and a space; output written by a
+// syscall is numbered after that syscall's TraceEvent. Lines read in one
+// chunk share a number and arrive in order.
+constexpr uint8_t kFlagSequenced = 0x04;
+
+struct Frame {
+    MsgType type = MsgType::Call;
+    uint8_t flags = 0;
+    uint32_t requestId = 0;
+    std::string payload;
+};
+
+class ProtocolError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+std::string encodeFrame(MsgType type, uint32_t requestId, const std::string& payload = "", uint8_t flags = 0);
+void appendFrame(std::string& out, MsgType type, uint32_t requestId, const std::string& payload = "", uint8_t flags = 0);
+// Splits a kFlagSequenced payload into its sequence number and text.
+// Returns false when it does not start with a number.
+bool splitSequenced(const std::string& payload, uint64_t& seq, std::string& text);
+
+// Accumulates bytes from a stream socket and cuts them into frames, so one
+// read may yield several frames and a frame may span many reads.
+class FrameReader {
+public:
+    explicit FrameReader(uint32_t maxPayload = kMaxFramePayload);
+
+    void feed(const char* data, size_t len);
+    // Returns false until a whole frame is buffered. Throws ProtocolError
+    // on a bad magic, an unknown version or an oversized payload.
+    bool next(Frame& out);
+
+    size_t buffered() const noexcept { return m_buf.size() - m_pos; }
+
+private:
+    std::string m_buf;
+    size_t m_pos;
+    uint32_t m_max_payload;
+};
+
+#endif
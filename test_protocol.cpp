@@ -0,0 +1,166 @@
+#include "Protocol.h"
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+static int failures = 0;
+
+static void check(bool ok, const std::string &what)
+{
+    if (!ok)
+    {
+        std::cerr << "FAIL: " << what << "\n";
+        ++failures;
+    }
+}
+
+static bool sameFrame(const Frame &a, const Frame &b)
+{
+    return a.type == b.type && a.flags == b.flags && a.requestId == b.requestId && a.payload == b.payload;
+}
+
+// Feeds `bytes` in pieces of `step` and collects every frame on the way.
+static std::vector<Frame> readAll(const std::string &bytes, size_t step, uint32_t maxPayload = kMaxFramePayload)
+{
+    FrameReader reader(maxPayload);
+    std::vector<Frame> frames;
+    Frame frame;
+    for (size_t pos = 0; pos < bytes.size(); pos += step)
+    {
+        reader.feed(bytes.data() + pos, std::min(step, bytes.size() - pos));
+        while (reader.next(frame))
+            frames.push_back(frame);
+    }
+    return frames;
+}
+
+static bool throwsProtocolError(const std::string &bytes, uint32_t maxPayload = kMaxFramePayload)
+{
+    try
+    {
+        readAll(bytes, bytes.size(), maxPayload);
+    }
+    catch (const ProtocolError &)
+    {
+        return true;
+    }
+    return false;
+}
+
+static void testHeaderLayout()
+{
+    std::string bytes = encodeFrame(MsgType::Trace, 0x01020304, "abc", kFlagIsolated);
+    check(bytes.size() == kFrameHeaderSize + 3, "frame size");
+    check(static_cast<uint8_t>(bytes[0]) == kFrameMagic, "magic byte");
+    check(static_cast<uint8_t>(bytes[1]) == kProtocolVersion, "version byte");
+    check(static_cast<uint8_t>(bytes[2]) == static_cast<uint8_t>(MsgType::Trace), "type byte");
+    check(static_cast<uint8_t>(bytes[3]) == kFlagIsolated, "flags byte");
+    check(bytes.compare(4, 4, "\x01\x02\x03\x04") == 0, "request id is big endian");
+    check(bytes.compare(8, 4, std::string("\0\0\0\x03", 4)) == 0, "length is big endian");
+    check(bytes.compare(12, 3, "abc") == 0, "payload follows the header");
+}
+
+static void testRoundTrip()
+{
+    std::vector<Frame> sent = {
+        {MsgType::Call, 0, 1, "hello"},
+        {MsgType::Trace, kFlagIsolated | kFlagStopOnError | kFlagSequenced, 0xffffffff, "int a = 1;"},
+        {MsgType::TraceEvent, kFlagSequenced, 7, "12 SYSCALL [42]: write"},
+        {MsgType::Output, 0, 7, std::string("binary\0\xff\x80 bytes", 16)},
+        {MsgType::TraceEnd, 0, 7, ""},
+        {MsgType::Cancel, 0, 7, ""},
+        {MsgType::Stats, 0, 8, std::string(100000, 'x')},
+    };
+    std::string bytes;
+    for (const Frame &f : sent)
+        appendFrame(bytes, f.type, f.requestId, f.payload, f.flags);
+
+    // Everything at once, byte by byte, and in pieces that cut headers.
+    for (size_t step : {bytes.size(), size_t(1), size_t(5), size_t(13), size_t(4096)})
+    {
+        std::vector<Frame> got = readAll(bytes, step);
+        check(got.size() == sent.size(), "frame count with step " + std::to_string(step));
+        for (size_t i = 0; i < got.size() && i < sent.size(); ++i)
+            check(sameFrame(got[i], sent[i]), "frame " + std::to_string(i) + " with step " + std::to_string(step));
+    }
+}
+
+static void testPartialFrames()
+{
+    std::string bytes = encodeFrame(MsgType::Output, 3, "partial");
+    FrameReader reader;
+    Frame frame;
+
+    reader.feed(bytes.data(), kFrameHeaderSize - 1);
+    check(!reader.next(frame), "no frame from half a header");
+    reader.feed(bytes.data() + kFrameHeaderSize - 1, 3);
+    check(!reader.next(frame), "no frame before the whole payload");
+    check(reader.buffered() == kFrameHeaderSize + 2, "partial bytes stay buffered");
+    reader.feed(bytes.data() + kFrameHeaderSize + 2, bytes.size() - kFrameHeaderSize - 2);
+    check(reader.next(frame) && frame.payload == "partial", "frame once the rest arrives");
+    check(reader.buffered() == 0 && !reader.next(frame), "nothing left after the frame");
+}
+
+static void testBadFrames()
+{
+    std::string bytes = encodeFrame(MsgType::Call, 1, "x");
+
+    std::string badMagic = bytes;
+    badMagic[0] = 'X';
+    check(throwsProtocolError(badMagic), "bad magic is rejected");
+
+    std::string badVersion = bytes;
+    badVersion[1] = static_cast<char>(kProtocolVersion + 1);
+    check(throwsProtocolError(badVersion), "unknown version is rejected");
+
+    // Rejected from the header alone, before the payload is buffered.
+    std::string tooLarge = encodeFrame(MsgType::Call, 1, std::string(65, 'x')).substr(0, kFrameHeaderSize);
+    check(throwsProtocolError(tooLarge, 64), "oversized payload is rejected");
+    check(!throwsProtocolError(encodeFrame(MsgType::Call, 1, std::string(64, 'x')), 64),
+          "payload at the limit is accepted");
+
+    // A bad frame after a good one: the good one is still delivered.
+    FrameReader reader;
+    std::string stream = bytes + badMagic;
+    reader.feed(stream.data(), stream.size());
+    Frame frame;
+    check(reader.next(frame) && frame.payload == "x", "frame before a bad one");
+    bool threw = false;
+    try
+    {
+        reader.next(frame);
+    }
+    catch (const ProtocolError &)
+    {
+        threw = true;
+    }
+    check(threw, "bad frame after a good one is rejected");
+}
+
+static void testSplitSequenced()
+{
+    uint64_t seq = 0;
+    std::string text;
+    check(splitSequenced("42 hello world", seq, text) && seq == 42 && text == "hello world", "sequenced payload");
+    check(splitSequenced("0 ", seq, text) && seq == 0 && text.empty(), "sequenced empty line");
+    check(!splitSequenced("hello", seq, text), "no sequence number");
+    check(!splitSequenced(" 42 x", seq, text), "leading space");
+    check(!splitSequenced("4a2 x", seq, text), "not a number");
+}
+
+int main()
+{
+    testHeaderLayout();
+    testRoundTrip();
+    testPartialFrames();
+    testBadFrames();
+    testSplitSequenced();
+
+    if (failures)
+    {
+        std::cerr << failures << " check(s) failed\n";
+        return 1;
+    }
+    std::cout << "All protocol checks passed\n";
+    return 0;
+}
@@ -0,0 +1,205 @@
+#include "Client.h"
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+// Cancel and run-limit scenarios against a live server, started with small
+// limits so they finish quickly:
+//
+//   pso_server 12345 --run-cpu-s=1 --run-wall-ms=3000 --run-mem-mb=256 --run-procs=8
+//   test_scenarios [port]
+
+static int failures = 0;
+
+static void check(bool ok, const std::string &what)
+{
+    std::cout << (ok ? "ok   " : "FAIL ") << what << "\n";
+    if (!ok)
+        ++failures;
+}
+
+static double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// A Trace over a bare socket, for what Client does not hand out: the
+// TRACE_END summary.
+struct TraceResult
+{
+    std::vector<std::string> output;
+    std::string end;
+    double seconds = 0;
+};
+
+static TraceResult runTrace(uint16_t port, const std::string &code)
+{
+    TraceResult result;
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0)
+        throw std::runtime_error("cannot connect to the server");
+    // A run the server fails to end fails the scenario instead of hanging it.
+    timeval timeout{30, 0};
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    auto start = std::chrono::steady_clock::now();
+    std::string request = encodeFrame(MsgType::Trace, 1, code, kFlagIsolated);
+    ::send(fd, request.data(), request.size(), MSG_NOSIGNAL);
+
+    FrameReader reader;
+    Frame frame;
+    char buf[4096];
+    for (;;)
+    {
+        while (reader.next(frame))
+        {
+            if (frame.type == MsgType::Output)
+                result.output.push_back(frame.payload);
+            else if (frame.type == MsgType::TraceEnd)
+            {
+                result.end = frame.payload;
+                result.seconds = secondsSince(start);
+                ::close(fd);
+                return result;
+            }
+        }
+        ssize_t n = ::recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0)
+            break;
+        reader.feed(buf, static_cast<size_t>(n));
+    }
+    ::close(fd);
+    throw std::runtime_error("no TRACE_END for: " + code);
+}
+
+static bool contains(const std::string &text, const std::string &part)
+{
+    return text.find(part) != std::string::npos;
+}
+
+static bool anyLineContains(const std::vector<std::string> &lines, const std::string &part)
+{
+    for (const std::string &line : lines)
+        if (contains(line, part))
+            return true;
+    return false;
+}
+
+static unsigned long statValue(const std::string &stats, const std::string &key)
+{
+    size_t pos = stats.find(" " + key + "=");
+    return pos == std::string::npos ? 0 : std::stoul(stats.substr(pos + key.size() + 2));
+}
+
+static void cancelScenarios(uint16_t port)
+{
+    Client client("127.0.0.1", port);
+    client.connectTo();
+    auto ignore = [](const std::string &) {};
+
+    // A program that never ends stops once cancelled.
+    std::vector<std::string> output;
+    bool done = false;
+    uint32_t id = client.traceAsync("volatile long i = 0; while (true) ++i;", ignore,
+                                    [&output](const std::string &line) { output.push_back(line); },
+                                    [&done](const std::string &) { done = true; }, true);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    auto start = std::chrono::steady_clock::now();
+    client.cancel(id);
+    client.wait(id);
+    check(done, "cancelled trace still ends");
+    check(secondsSince(start) < 1.0, "cancel stops the program within a second");
+    check(anyLineContains(output, "Cancelled"), "cancelled trace says so");
+
+    // Cancelling a finished request changes nothing.
+    output.clear();
+    id = client.traceAsync("printf(\"done\\n\");", ignore,
+                           [&output](const std::string &line) { output.push_back(line); }, nullptr, true);
+    client.wait(id);
+    client.cancel(id);
+    check(anyLineContains(output, "done") && !anyLineContains(output, "Cancelled"),
+          "finished trace is not cancelled");
+
+    // The connection is still usable, and cancel takes only its own request.
+    std::vector<std::string> kept;
+    uint32_t slow = client.traceAsync("sleep(60);", ignore, ignore, nullptr, true);
+    client.traceAsync("printf(\"kept\\n\");", ignore,
+                      [&kept](const std::string &line) { kept.push_back(line); }, nullptr, true);
+    client.cancel(slow);
+    client.waitAll();
+    check(anyLineContains(kept, "kept") && !anyLineContains(kept, "Cancelled"),
+          "cancel leaves other requests alone");
+
+    // Closing the connection cancels what it left running.
+    unsigned long before = statValue(client.stats(), "cancelled");
+    Client leaving("127.0.0.1", port);
+    leaving.connectTo();
+    leaving.traceAsync("while (true) {}", ignore, ignore, nullptr, true);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    leaving.close();
+    unsigned long after = before;
+    for (int i = 0; i < 20 && after == before; ++i)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        after = statValue(client.stats(), "cancelled");
+    }
+    check(after == before + 1, "disconnect cancels the running trace");
+}
+
+static void limitScenarios(uint16_t port)
+{
+    TraceResult r = runTrace(port, "sleep(600);");
+    check(contains(r.end, "limit=wall"), "sleeping program hits the wall-clock limit");
+
+    r = runTrace(port, "volatile long i = 0; while (true) ++i;");
+    check(contains(r.end, "limit=cpu"), "busy loop hits the CPU limit");
+
+    r = runTrace(port, "std::vector<char> v(size_t(2) << 30, 1); printf(\"%d\\n\", v[12345]);");
+    check(contains(r.end, "limit=memory"), "large allocation hits the memory limit");
+
+    r = runTrace(port, "for (int i = 0; i < 1000; ++i) if (fork() == 0) { pause(); _exit(0); }");
+    check(contains(r.end, "limit=processes"), "fork loop hits the process limit");
+
+    // Limits are reported in TRACE_END only, never as program output.
+    check(!anyLineContains(r.output, "Limit"), "limit is not mixed into the output");
+
+    // A child leaving the process group would outlive the run.
+    r = runTrace(port, "if (fork() == 0) { printf(\"setsid=%d\\n\", (int)setsid()); fflush(stdout); "
+                       "while (true) {} } printf(\"parent\\n\");");
+    check(contains(r.end, "limit=none") && anyLineContains(r.output, "setsid=-1") && r.seconds < 2.0,
+          "setsid is refused and the child ends with the run");
+
+    r = runTrace(port, "printf(\"after\\n\");");
+    check(contains(r.end, "limit=none") && anyLineContains(r.output, "after"), "next run is unaffected");
+}
+
+int main(int argc, char *argv[])
+{
+    uint16_t port = argc > 1 ? static_cast<uint16_t>(std::stoi(argv[1])) : 12345;
+    try
+    {
+        cancelScenarios(port);
+        limitScenarios(port);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+
+    if (failures)
+    {
+        std::cerr << failures << " scenario(s) failed\n";
+        return 1;
+    }
+    return 0;
+}